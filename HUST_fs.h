@@ -10,6 +10,10 @@
 #include <linux/uaccess.h>
 #include <linux/buffer_head.h>
 #include <linux/slab.h>
+#include <linux/jbd2.h>
+#include <linux/percpu_counter.h>
+#include <linux/kobject.h>
+#include <linux/completion.h>
 #include "constants.h"
 
 #define setbit(number,x) number |= 1UL << x
@@ -28,9 +32,127 @@ struct HUST_fs_super_block {
 	uint64_t imap_block;
 	uint64_t inode_table_block;
 	uint64_t data_block_number;
-	char padding[4016];
+
+	uint64_t features;
+	uint64_t inodes_per_group;
+	uint64_t groups_count;
+	uint64_t gdt_block;
+	uint64_t max_inodes;	/* imap and gdt capacity for growth */
+	uint64_t journal_block;	/* with HUST_FEATURE_JOURNAL */
+	uint64_t journal_blocks;
+	uint64_t state;		/* HUST_STATE_* */
+	uint64_t free_inodes;	/* exact only with HUST_STATE_CLEAN */
+	char padding[3944];
+};
+
+struct HUST_group_desc {
+	uint64_t itable_block;
+	uint32_t itable_blocks;
+	uint32_t flags;
+};
+
+/* The block size is chosen by mkfs; sb->s_blocksize holds it once mounted. */
+#define HUST_BLOCK_SIZE(sb) ((sb)->s_blocksize)
+#define HUST_BITS_PER_BLOCK(sb) (HUST_BLOCK_SIZE(sb) * 8)
+#define HUST_DESC_PER_BLOCK(sb) (HUST_BLOCK_SIZE(sb) / sizeof(struct HUST_group_desc))
+#define HUST_ADDR_PER_BLOCK(sb) (HUST_BLOCK_SIZE(sb) / sizeof(uint64_t))
+
+/* mount options, see HUST_fs_parse_options() */
+#define HUST_MOUNT_DEBUG 0x1		/* report mount and inode table events */
+#define HUST_MOUNT_ALLOC_GOAL 0x2	/* allocate after a file's last block */
+
+struct HUST_mount_opts {
+	unsigned long mount_opt;	/* HUST_MOUNT_* */
+	unsigned long commit_interval;	/* jiffies */
+	unsigned int inode_readahead;	/* table blocks read with a cold one */
+	unsigned int dircache_blocks;	/* 0: no directory name cache */
+};
+
+/* per-mount counters, see stats.c */
+enum {
+	HUST_STAT_BUFFER_READS,		/* metadata and data blocks read */
+	HUST_STAT_BITMAP_SCANS,		/* searches of a bitmap for free bits */
+	HUST_STAT_BITS_SCANNED,
+	HUST_STAT_ALLOC_OK,		/* block allocations */
+	HUST_STAT_ALLOC_FAIL,
+	HUST_STAT_LOOKUP_HIT,
+	HUST_STAT_LOOKUP_MISS,
+	HUST_STAT_DIR_SEARCHES,		/* HUST_dir_find_entry() calls */
+	HUST_STAT_DIRENTS_SCANNED,	/* records they compared */
+	HUST_STAT_ITABLE_READS,		/* on-disk inodes read */
+	HUST_STAT_NR
+};
+
+enum {
+	HUST_LAT_GET_BLOCK,
+	HUST_LAT_LOOKUP,
+	HUST_LAT_CREATE,
+	HUST_LAT_NR
+};
+
+struct HUST_stats {
+	u64 count[HUST_STAT_NR];
+	u64 lat[HUST_LAT_NR][HUST_LAT_BUCKETS];	/* log2 of nanoseconds */
+};
+
+/*
+ * In-memory superblock.  s_disk points into s_sbh, which stays pinned
+ * for the lifetime of the mount.
+ */
+struct HUST_sb_info {
+	struct super_block *s_sb;
+	struct HUST_mount_opts s_opts;
+	struct buffer_head *s_sbh;
+	struct HUST_fs_super_block *s_disk;
+	unsigned int s_inode_size;
+
+	uint64_t s_inodes_per_group;
+	uint64_t s_groups_count;
+	uint64_t s_max_groups;
+	struct HUST_group_desc *s_gd;	/* s_max_groups entries */
+	struct mutex s_grow_mutex;	/* adds groups to the inode table */
+	struct mutex s_itable_mutex;	/* clears HUST_BG_ITABLE_UNINIT */
+	struct mutex s_bmap_mutex;	/* block bitmap searches and updates */
+	struct mutex s_imap_mutex;	/* inode bitmap searches and updates */
+	struct delayed_work s_itable_work;
+	uint64_t s_itable_next;		/* next group for the lazy init work */
+	journal_t *s_journal;		/* NULL without HUST_FEATURE_JOURNAL */
+
+	/* the superblock's copies are refreshed by HUST_fs_commit_super() */
+	struct percpu_counter s_freeblocks_counter;
+	struct percpu_counter s_freeinodes_counter;
+	struct delayed_work s_sb_work;	/* periodic HUST_fs_commit_super() */
+
+	struct HUST_stats __percpu *s_stats;
+	struct kobject s_kobj;		/* /sys/fs/HUST_fs/<dev> */
+	struct completion s_kobj_unregister;
 };
 
+static inline struct HUST_sb_info *HUST_SB(struct super_block *sb)
+{
+	return sb->s_fs_info;
+}
+
+static inline void HUST_stat_add(struct super_block *sb, int item, u64 n)
+{
+	this_cpu_add(HUST_SB(sb)->s_stats->count[item], n);
+}
+
+static inline void HUST_stat_inc(struct super_block *sb, int item)
+{
+	this_cpu_inc(HUST_SB(sb)->s_stats->count[item]);
+}
+
+/* sb_bread() that counts the read */
+static inline struct buffer_head *HUST_sb_bread(struct super_block *sb,
+						sector_t block)
+{
+	HUST_stat_inc(sb, HUST_STAT_BUFFER_READS);
+	return sb_bread(sb, block);
+}
+
+#define HUST_test_opt(sb, opt) (HUST_SB(sb)->s_opts.mount_opt & HUST_MOUNT_##opt)
+
 struct HUST_inode {
 	mode_t mode; //sizeof(mode_t) is 4
 	uint64_t inode_no;
@@ -46,37 +168,182 @@ struct HUST_inode {
     int64_t i_atime;
     int64_t i_mtime;
     int64_t i_ctime;
-    char padding[112];
+    uint32_t i_atime_nsec;
+    uint32_t i_mtime_nsec;
+    uint32_t i_ctime_nsec;
+    uint32_t i_flags;
+    char padding[96];
 };
 
 #define HUST_INODE_SIZE sizeof(struct HUST_inode)
+
+/*
+ * On-disk inode for version 2 file systems.  Every field is naturally
+ * aligned and the record is exactly HUST_INODE_V2_SIZE bytes, so a table
+ * block holds a power-of-two number of inodes and none spans two blocks.
+ */
+struct HUST_inode_v2 {
+	uint32_t mode;
+	uint32_t i_nlink;
+	uint32_t i_uid;
+	uint32_t i_gid;
+	uint64_t inode_no;
+	union {
+		uint64_t file_size;
+		uint64_t dir_children_count;
+	};
+	uint32_t blocks;
+	uint32_t i_flags;
+	uint32_t block[HUST_N_BLOCKS];
+	int64_t i_atime;
+	int64_t i_mtime;
+	int64_t i_ctime;
+	uint32_t i_atime_nsec;
+	uint32_t i_mtime_nsec;
+	uint32_t i_ctime_nsec;
+	uint32_t i_reserved[3];
+} __attribute__((packed));
+
+static inline unsigned int HUST_inode_size(struct super_block *sb)
+{
+	return HUST_SB(sb)->s_inode_size;
+}
+
+/*
+ * In-memory part of an inode.  The block map and directory metadata are
+ * decoded once when the inode is read into the icache, so the hot paths
+ * never go back to the inode table for them.
+ */
+struct HUST_inode_info {
+	uint64_t blocks;
+	uint64_t block[HUST_N_BLOCKS];
+	uint64_t dir_children_count;
+	uint32_t i_flags;
+	struct HUST_dircache __rcu *i_dircache;	/* names of a directory, or NULL */
+	tid_t i_sync_tid;		/* last transaction that logged the inode */
+	uint64_t i_bmap_lo, i_bmap_hi;	/* bitmap blocks changed since fsync */
+	struct mutex alloc_mutex;	/* serializes block[] growth */
+	struct inode vfs_inode;
+};
+
+static inline struct HUST_inode_info *HUST_I(struct inode *inode)
+{
+	return container_of(inode, struct HUST_inode_info, vfs_inode);
+}
 struct HUST_dir_record {
 	char filename[HUST_FILENAME_MAX_LEN];
 	uint64_t inode_no;
 };
 
+/*
+ * Directory entry with HUST_FEATURE_VARDIR.  Records are 8-byte aligned
+ * and rec_len reaches to the next record, the last one to the end of the
+ * block; an entry with name_len 0 is unused space.
+ */
+struct HUST_dir_entry {
+	uint64_t inode_no;
+	uint16_t rec_len;
+	uint8_t name_len;
+	uint8_t file_type;	/* HUST_FT_* */
+	char name[];
+} __attribute__((packed));
+
+#define HUST_DIR_ENTRY_HDR sizeof(struct HUST_dir_entry)
+#define HUST_DIR_REC_LEN(name_len) (((name_len) + HUST_DIR_ENTRY_HDR + 7) & ~7)
+
+/*
+ * rec_len is 16 bits; a record spanning a whole 64K block is stored as
+ * HUST_MAX_REC_LEN, like ext4 does.
+ */
+#define HUST_MAX_REC_LEN 0xffff
+
+static inline unsigned int HUST_rec_len(const struct HUST_dir_entry *e)
+{
+	return e->rec_len == HUST_MAX_REC_LEN ? 1 << 16 : e->rec_len;
+}
+
+static inline void HUST_set_rec_len(struct HUST_dir_entry *e, unsigned int len)
+{
+	e->rec_len = len >= (1 << 16) ? HUST_MAX_REC_LEN : len;
+}
+
+/* A used directory record, decoded from either on-disk format. */
+struct HUST_dirent {
+	const char *name;
+	unsigned int name_len;
+	unsigned int file_type;
+	uint64_t inode_no;
+	unsigned int offset;	/* of the record in its block */
+	unsigned int next;	/* where the following record starts */
+};
+
+/*
+ * Hashed directory index block, the root (directory block 0) or an
+ * interior node.  It starts with what reads as an unused record of
+ * either format covering the block, so a linear scan passes over it.
+ */
+struct HUST_dx_header {
+	uint64_t fake_inode;	/* zero */
+	uint16_t fake_rec_len;	/* the block size, zero with fixed records */
+	uint8_t fake_name_len;	/* zero */
+	uint8_t levels;		/* root only: node levels below it */
+	uint32_t magic;
+	uint16_t count;
+	uint16_t limit;
+	uint32_t reserved;
+};
+
+struct HUST_dx_entry {
+	uint32_t hash;		/* lowest name hash in the subtree */
+	uint32_t block;		/* directory block number */
+};
+
+#define HUST_DX_LIMIT(sb) ((HUST_BLOCK_SIZE(sb) - sizeof(struct HUST_dx_header)) / \
+			   sizeof(struct HUST_dx_entry))
+
 //inode_map anf block_map
 int checkbit(uint8_t number, int x);
-int HUST_find_first_zero_bit(const void *vaddr, unsigned size);
+uint64_t HUST_find_first_zero_bit(const void *vaddr, uint64_t size);
 int get_bmap(struct super_block* sb, uint8_t* bmap, ssize_t bmap_size);
 int get_imap(struct super_block* sb, uint8_t* imap, ssize_t imap_size);
 uint64_t HUST_fs_get_empty_block(struct super_block* sb);
-uint64_t HUST_fs_get_empty_inode(struct super_block* sb);
-int save_bmap(struct super_block* sb, uint8_t* bmap, ssize_t bmap_size);
+int HUST_fs_take_inode(struct super_block *sb, uint64_t *inode_no);
+void HUST_fs_release_inode(struct super_block *sb, uint64_t inode_no);
+int save_bmap(struct super_block* sb, uint8_t* bmap, ssize_t bmap_size,
+              struct inode *owner);
 int set_and_save_imap(struct super_block* sb, uint64_t inode_num, uint8_t value);
 int set_and_save_bmap(struct super_block* sb, uint64_t block_num, uint8_t value);
+void HUST_fs_release_block(struct super_block *sb, uint64_t blk);
+int HUST_fs_alloc_contig_blocks(struct super_block* sb, uint64_t count, uint64_t* start);
+int HUST_fs_count_free(struct super_block *sb, uint64_t *free_blocks,
+                       uint64_t *free_inodes);
 
 //block oprations
 int save_block(struct super_block* sb, uint64_t block_num, void* buf, ssize_t size);
 int HUST_fs_get_block(struct inode *inode, sector_t block,
                        struct buffer_head *bh, int create);
-int alloc_block_for_inode(struct super_block* sb, struct HUST_inode* p_H_inode, ssize_t size);
+int alloc_block_for_inode(struct inode *inode, ssize_t nr_blocks);
+struct buffer_head *HUST_fs_getblk_new(struct super_block *sb, uint64_t blk);
+uint64_t HUST_fs_max_blocks(struct super_block *sb);
+int HUST_fs_bmap(struct inode *inode, uint64_t lblk, uint64_t *pblk);
+int HUST_fs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+		   u64 start, u64 len);
 
 //inode oprerations
 ssize_t HUST_read_inode_data(struct inode* inode,void* buf, size_t size);
 ssize_t HUST_write_inode_data(struct inode* inode, const void *buf, size_t count);
 int save_inode(struct super_block* sb, struct HUST_inode H_inode);
+struct buffer_head *HUST_fs_update_inode(struct super_block *sb,
+					 const struct HUST_inode *H_inode);
 int HUST_fs_get_inode(struct super_block* sb, uint64_t inode_no, struct HUST_inode* raw_inode);
+void HUST_fs_fill_raw_inode(struct inode *inode, struct HUST_inode *raw_inode);
+void HUST_fs_inode_readahead(struct super_block *sb, uint64_t inode_no,
+			     uint64_t *last);
+struct inode *HUST_fs_iget(struct super_block *sb, uint64_t inode_no);
+struct inode *HUST_fs_alloc_inode(struct super_block *sb);
+void HUST_fs_destroy_inode(struct inode *inode);
+int HUST_init_inodecache(void);
+void HUST_destroy_inodecache(void);
 
 //file operations
 int HUST_fs_readpage(struct file *file, struct page *page);
@@ -84,6 +351,12 @@ int HUST_fs_writepage(struct page* page, struct writeback_control* wbc);
 int HUST_fs_write_begin(struct file* file, struct address_space* mapping, 
 		loff_t pos, unsigned len, unsigned flags, 
 		struct page** pagep, void** fsdata);
+ssize_t HUST_fs_copy_file_range(struct file *file_in, loff_t pos_in,
+				struct file *file_out, loff_t pos_out,
+				size_t len, unsigned int flags);
+long HUST_fs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+long HUST_fs_compat_ioctl(struct file *filp, unsigned int cmd,
+			  unsigned long arg);
 
 
 //dir operations
@@ -98,11 +371,99 @@ int HUST_fs_unlink(struct inode *dir, struct dentry *dentry);
 struct dentry* HUST_fs_lookup(struct inode *parent_inode, struct dentry *child_dentry,
     unsigned int flags);
 
+//directory entries
+uint32_t HUST_dir_hash(const char *name, unsigned int len);
+int HUST_dir_is_index(const void *data);
+struct buffer_head *HUST_dir_bread(struct inode *dir, uint64_t lblk);
+int HUST_dir_leaf_next(struct inode *dir, void *data, unsigned int offset,
+		       struct HUST_dirent *de);
+unsigned int HUST_dir_leaf_validate(struct inode *dir, void *data,
+				    unsigned int offset);
+int HUST_dir_delete_entry(struct inode *dir, const struct HUST_dirent *de,
+			  struct buffer_head *bh);
+int HUST_dir_find_entry(struct inode *dir, const struct qstr *name,
+			struct HUST_dirent *de, struct buffer_head **res_bh);
+int HUST_dx_readdir(struct file *filp, struct dir_context *ctx);
+loff_t HUST_dir_llseek(struct file *filp, loff_t offset, int whence);
+int HUST_dir_add_entry(struct inode *dir, const struct qstr *name,
+		       uint64_t inode_no, umode_t mode);
+unsigned char HUST_dir_dtype(const struct HUST_dirent *de);
+int HUST_dir_make_empty(struct inode *inode, struct inode *parent);
+
+//directory name cache
+struct HUST_dircache;
+int HUST_dircache_lookup(struct inode *dir, const struct qstr *name);
+void HUST_dircache_add(struct inode *dir, const struct qstr *name);
+void HUST_dircache_del(struct inode *dir, const struct qstr *name);
+void HUST_dircache_drop(struct inode *dir);
+int HUST_dircache_init(void);
+void HUST_dircache_exit(void);
+
+//group descriptors
+int HUST_fs_load_groups(struct super_block *sb);
+int HUST_fs_save_group_desc(struct super_block *sb, uint64_t group);
+int HUST_fs_itable_uninit(struct super_block *sb, uint64_t group);
+int HUST_fs_init_itable(struct super_block *sb, uint64_t group);
+void HUST_fs_itable_work(struct work_struct *work);
+void HUST_fs_start_itable_init(struct super_block *sb);
+int HUST_fs_grow_itable(struct super_block *sb, uint64_t seen_inodes_count);
+
+//online grow
+int HUST_fs_resize(struct super_block *sb, uint64_t *new_count);
+
+//statistics
+void HUST_stat_latency(struct super_block *sb, int which, u64 start);
+int HUST_stats_setup(struct super_block *sb);
+int HUST_stats_register(struct super_block *sb);
+void HUST_stats_release(struct super_block *sb);
+int HUST_stats_init(void);
+void HUST_stats_exit(void);
+
+//metadata journal
+/*
+ * Buffers a transaction may dirty at most.  Each is a worst case: a
+ * create can allocate an inode group, turn its directory into an index
+ * and split a leaf and an index node in one go.
+ */
+#define HUST_INODE_CREDITS 2	/* inode table block and superblock */
+#define HUST_CREATE_CREDITS 64
+#define HUST_UNLINK_CREDITS 8
+#define HUST_EVICT_CREDITS 4
+#define HUST_GDT_CREDITS 2
+handle_t *HUST_journal_start(struct super_block *sb, int nblocks);
+int HUST_journal_stop(handle_t *handle);
+int HUST_journal_get_write_access(struct super_block *sb, struct buffer_head *bh);
+int HUST_journal_get_create_access(struct super_block *sb, struct buffer_head *bh);
+int HUST_journal_dirty_metadata(struct super_block *sb, struct buffer_head *bh);
+int HUST_journal_dirty_inode_buffer(struct inode *inode, struct buffer_head *bh);
+int HUST_journal_alloc_credits(struct super_block *sb, uint64_t nr_blocks);
+uint64_t HUST_journal_max_alloc(struct super_block *sb);
+int HUST_journal_load(struct super_block *sb);
+void HUST_journal_release(struct super_block *sb);
+int HUST_journal_commit(struct super_block *sb, tid_t tid);
+int HUST_journal_sync(struct super_block *sb, int wait);
+int HUST_journal_flush(struct super_block *sb);
+void HUST_fs_dirty_inode(struct inode *inode, int flags);
+int HUST_fs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+
+//metadata writeback
+int HUST_meta_write(struct buffer_head **bhs, int nr);
+int HUST_meta_sync_inode(struct inode *inode, struct buffer_head *extra);
+void HUST_meta_note_bmap(struct inode *inode, uint64_t idx);
+int HUST_meta_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+
 //super_block operations
 int save_super(struct super_block* sb);
+int HUST_fs_commit_super(struct super_block *sb);
+void HUST_fs_super_changed(struct super_block *sb);
 int HUST_fs_fill_super(struct super_block *sb, void *data, int silent);
+int HUST_fs_sync_fs(struct super_block *sb, int wait);
+int HUST_fs_statfs(struct dentry *dentry, struct kstatfs *buf);
+int HUST_fs_remount(struct super_block *sb, int *flags, char *data);
+int HUST_fs_show_options(struct seq_file *seq, struct dentry *root);
 int HUST_write_inode(struct inode *inode, struct writeback_control *wbc);
 void HUST_evict_inode(struct inode *vfs_inode);
+void HUST_fs_put_super(struct super_block *sb);
 
 //file-system operations
 struct dentry* HUST_fs_mount(struct file_system_type *fs_type, int flags,
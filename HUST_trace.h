@@ -0,0 +1,361 @@
+/*
+ * Tracepoints, under events/hust_fs/ in tracefs:
+ *   trace-cmd record -e hust_fs:get_block -e hust_fs:alloc ...
+ *   perf trace -e 'hust_fs:*'
+ * A disabled tracepoint costs one patched-out branch.  super.c expands
+ * the events with CREATE_TRACE_POINTS.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM hust_fs
+
+#if !defined(_HUST_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _HUST_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(get_block,
+	TP_PROTO(struct inode *inode, sector_t lblk, int create,
+		 sector_t pblk, int ret),
+	TP_ARGS(inode, lblk, create, pblk, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(sector_t, lblk)
+		__field(sector_t, pblk)
+		__field(int, create)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->lblk = lblk;
+		__entry->pblk = pblk;
+		__entry->create = create;
+		__entry->ret = ret;
+	),
+	TP_printk("dev %d,%d ino %lu lblk %llu create %d pblk %llu ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  (unsigned long long)__entry->lblk, __entry->create,
+		  (unsigned long long)__entry->pblk, __entry->ret)
+);
+
+TRACE_EVENT(alloc,
+	TP_PROTO(struct inode *inode, uint64_t want, uint64_t got,
+		 uint64_t meta, uint64_t first, int ret),
+	TP_ARGS(inode, want, got, meta, first, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(uint64_t, want)
+		__field(uint64_t, got)
+		__field(uint64_t, meta)
+		__field(uint64_t, first)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->want = want;
+		__entry->got = got;
+		__entry->meta = meta;
+		__entry->first = first;
+		__entry->ret = ret;
+	),
+	TP_printk("dev %d,%d ino %lu want %llu got %llu first %llu meta %llu ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->want, __entry->got, __entry->first, __entry->meta,
+		  __entry->ret)
+);
+
+TRACE_EVENT(alloc_contig,
+	TP_PROTO(struct super_block *sb, uint64_t count, uint64_t start,
+		 int ret),
+	TP_ARGS(sb, count, start, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(uint64_t, count)
+		__field(uint64_t, start)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->count = count;
+		__entry->start = start;
+		__entry->ret = ret;
+	),
+	TP_printk("dev %d,%d count %llu start %llu ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->count,
+		  __entry->start, __entry->ret)
+);
+
+DECLARE_EVENT_CLASS(hust_fs_page,
+	TP_PROTO(struct page *page),
+	TP_ARGS(page),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(pgoff_t, index)
+	),
+	TP_fast_assign(
+		__entry->dev = page->mapping->host->i_sb->s_dev;
+		__entry->ino = page->mapping->host->i_ino;
+		__entry->index = page->index;
+	),
+	TP_printk("dev %d,%d ino %lu page %lu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  (unsigned long)__entry->index)
+);
+
+DEFINE_EVENT(hust_fs_page, readpage,
+	TP_PROTO(struct page *page),
+	TP_ARGS(page)
+);
+
+DEFINE_EVENT(hust_fs_page, writepage,
+	TP_PROTO(struct page *page),
+	TP_ARGS(page)
+);
+
+TRACE_EVENT(write_begin,
+	TP_PROTO(struct inode *inode, loff_t pos, unsigned int len, int ret),
+	TP_ARGS(inode, pos, len, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(loff_t, pos)
+		__field(unsigned int, len)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->pos = pos;
+		__entry->len = len;
+		__entry->ret = ret;
+	),
+	TP_printk("dev %d,%d ino %lu pos %lld len %u ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->pos, __entry->len, __entry->ret)
+);
+
+/* @ret is -ENOENT for a negative entry, @cached if the name cache said so */
+TRACE_EVENT(lookup,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, uint64_t ino,
+		 int cached, int ret),
+	TP_ARGS(dir, dentry, ino, cached, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, dir)
+		__field(uint64_t, ino)
+		__field(int, cached)
+		__field(int, ret)
+		__string(name, dentry->d_name.name)
+	),
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->ino = ino;
+		__entry->cached = cached;
+		__entry->ret = ret;
+		__assign_str(name, dentry->d_name.name);
+	),
+	TP_printk("dev %d,%d dir %lu name %s ino %llu cached %d ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		  __get_str(name), __entry->ino, __entry->cached, __entry->ret)
+);
+
+TRACE_EVENT(iterate,
+	TP_PROTO(struct inode *dir, loff_t pos, int ret),
+	TP_ARGS(dir, pos, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, dir)
+		__field(loff_t, pos)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->pos = pos;
+		__entry->ret = ret;
+	),
+	TP_printk("dev %d,%d dir %lu pos %lld ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		  __entry->pos, __entry->ret)
+);
+
+/* @block 0: the group's table is not zeroed yet, nothing was read */
+DECLARE_EVENT_CLASS(hust_fs_inode_io,
+	TP_PROTO(struct super_block *sb, uint64_t ino, uint64_t block),
+	TP_ARGS(sb, ino, block),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(uint64_t, ino)
+		__field(uint64_t, block)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->ino = ino;
+		__entry->block = block;
+	),
+	TP_printk("dev %d,%d ino %llu block %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->block)
+);
+
+DEFINE_EVENT(hust_fs_inode_io, get_inode,
+	TP_PROTO(struct super_block *sb, uint64_t ino, uint64_t block),
+	TP_ARGS(sb, ino, block)
+);
+
+DEFINE_EVENT(hust_fs_inode_io, save_inode,
+	TP_PROTO(struct super_block *sb, uint64_t ino, uint64_t block),
+	TP_ARGS(sb, ino, block)
+);
+
+TRACE_EVENT(create,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, uint64_t ino,
+		 umode_t mode, int ret),
+	TP_ARGS(dir, dentry, ino, mode, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, dir)
+		__field(uint64_t, ino)
+		__field(umode_t, mode)
+		__field(int, ret)
+		__string(name, dentry->d_name.name)
+	),
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->ino = ino;
+		__entry->mode = mode;
+		__entry->ret = ret;
+		__assign_str(name, dentry->d_name.name);
+	),
+	TP_printk("dev %d,%d dir %lu name %s ino %llu mode 0%o ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		  __get_str(name), __entry->ino, __entry->mode, __entry->ret)
+);
+
+TRACE_EVENT(unlink,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, int ret),
+	TP_ARGS(dir, dentry, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, dir)
+		__field(unsigned long, ino)
+		__field(int, ret)
+		__string(name, dentry->d_name.name)
+	),
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->ino = d_inode(dentry)->i_ino;
+		__entry->ret = ret;
+		__assign_str(name, dentry->d_name.name);
+	),
+	TP_printk("dev %d,%d dir %lu name %s ino %lu ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		  __get_str(name), __entry->ino, __entry->ret)
+);
+
+TRACE_EVENT(evict,
+	TP_PROTO(struct inode *inode),
+	TP_ARGS(inode),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(unsigned int, nlink)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->nlink = inode->i_nlink;
+	),
+	TP_printk("dev %d,%d ino %lu nlink %u",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->nlink)
+);
+
+/* A whole bitmap copied out of the buffer cache for a scan. */
+DECLARE_EVENT_CLASS(hust_fs_bitmap_read,
+	TP_PROTO(struct super_block *sb, size_t bytes),
+	TP_ARGS(sb, bytes),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(size_t, bytes)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->bytes = bytes;
+	),
+	TP_printk("dev %d,%d bytes %zu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->bytes)
+);
+
+DEFINE_EVENT(hust_fs_bitmap_read, read_bmap,
+	TP_PROTO(struct super_block *sb, size_t bytes),
+	TP_ARGS(sb, bytes)
+);
+
+DEFINE_EVENT(hust_fs_bitmap_read, read_imap,
+	TP_PROTO(struct super_block *sb, size_t bytes),
+	TP_ARGS(sb, bytes)
+);
+
+/* One bit set or cleared in place. */
+DECLARE_EVENT_CLASS(hust_fs_bitmap_bit,
+	TP_PROTO(struct super_block *sb, uint64_t nr, int value),
+	TP_ARGS(sb, nr, value),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(uint64_t, nr)
+		__field(int, value)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->nr = nr;
+		__entry->value = value;
+	),
+	TP_printk("dev %d,%d nr %llu value %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->nr,
+		  __entry->value)
+);
+
+DEFINE_EVENT(hust_fs_bitmap_bit, set_bmap,
+	TP_PROTO(struct super_block *sb, uint64_t nr, int value),
+	TP_ARGS(sb, nr, value)
+);
+
+DEFINE_EVENT(hust_fs_bitmap_bit, set_imap,
+	TP_PROTO(struct super_block *sb, uint64_t nr, int value),
+	TP_ARGS(sb, nr, value)
+);
+
+TRACE_EVENT(save_bmap,
+	TP_PROTO(struct super_block *sb, unsigned int dirtied, int ret),
+	TP_ARGS(sb, dirtied, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned int, dirtied)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->dirtied = dirtied;
+		__entry->ret = ret;
+	),
+	TP_printk("dev %d,%d blocks dirtied %u ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dirtied,
+		  __entry->ret)
+);
+
+#endif /* _HUST_TRACE_H */
+
+/* out of the kernel tree: found through -I$(src), see the Makefile */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE HUST_trace
+#include <trace/define_trace.h>
@@ -1,5 +1,7 @@
 #include "constants.h"
 #include "HUST_fs.h"
+#include "HUST_trace.h"
+#include <linux/blkdev.h>
 
 int save_block(struct super_block* sb, uint64_t block_num, void* buf, ssize_t size)
 {
@@ -10,72 +12,476 @@ int save_block(struct super_block* sb, uint64_t block_num, void* buf, ssize_t si
      * 3. save block
      */
     struct HUST_fs_super_block *disk_sb;
-    disk_sb = sb->s_fs_info;
+    disk_sb = HUST_SB(sb)->s_disk;
     struct buffer_head* bh;
-    bh = sb_bread(sb, block_num+disk_sb->data_block_number);
+    int err;
+    bh = HUST_sb_bread(sb, block_num+disk_sb->data_block_number);
     
     BUG_ON(!bh);
-    memset(bh->b_data, 0, HUST_BLOCKSIZE);
+    err = HUST_journal_get_write_access(sb, bh);
+    if (err) {
+        brelse(bh);
+        return err;
+    }
+    memset(bh->b_data, 0, HUST_BLOCK_SIZE(sb));
     memcpy(bh->b_data, buf, size);
+    err = HUST_journal_dirty_metadata(sb, bh);
     brelse(bh);
-    return 0;
+    return err;
+}
+/*
+ * With HUST_FEATURE_INDIRECT the first HUST_NDIR_BLOCKS entries of
+ * block[] map data directly, block[HUST_IND_BLOCK] points to a block of
+ * HUST_ADDR_PER_BLOCK addresses and block[HUST_DIND_BLOCK] to a block of
+ * such blocks.  Without it all HUST_N_BLOCKS entries are direct.
+ */
+uint64_t HUST_fs_max_blocks(struct super_block *sb)
+{
+	if (!(HUST_SB(sb)->s_disk->features & HUST_FEATURE_INDIRECT))
+		return HUST_N_BLOCKS;
+	return HUST_NDIR_BLOCKS + HUST_ADDR_PER_BLOCK(sb) +
+	    HUST_ADDR_PER_BLOCK(sb) * HUST_ADDR_PER_BLOCK(sb);
+}
+
+/* Slots leading from block[] to logical block @lblk; returns the depth. */
+static int HUST_fs_block_path(struct super_block *sb, uint64_t lblk,
+			      unsigned int path[3])
+{
+	if (lblk < HUST_NDIR_BLOCKS ||
+	    !(HUST_SB(sb)->s_disk->features & HUST_FEATURE_INDIRECT)) {
+		path[0] = lblk;
+		return 1;
+	}
+	lblk -= HUST_NDIR_BLOCKS;
+	if (lblk < HUST_ADDR_PER_BLOCK(sb)) {
+		path[0] = HUST_IND_BLOCK;
+		path[1] = lblk;
+		return 2;
+	}
+	lblk -= HUST_ADDR_PER_BLOCK(sb);
+	path[0] = HUST_DIND_BLOCK;
+	path[1] = lblk / HUST_ADDR_PER_BLOCK(sb);
+	path[2] = lblk % HUST_ADDR_PER_BLOCK(sb);
+	return 3;
+}
+
+/*
+ * Physical block of logical block @lblk, which must be below hi->blocks.
+ * Mapped blocks never move, so this needs no lock.
+ */
+int HUST_fs_bmap(struct inode *inode, uint64_t lblk, uint64_t *pblk)
+{
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bh;
+	unsigned int path[3];
+	uint64_t blk;
+	int depth, i;
+
+	depth = HUST_fs_block_path(sb, lblk, path);
+	blk = HUST_I(inode)->block[path[0]];
+	for (i = 1; i < depth; i++) {
+		if (!blk)
+			break;
+		bh = HUST_sb_bread(sb, blk);
+		if (!bh)
+			return -EIO;
+		blk = ((uint64_t *)bh->b_data)[path[i]];
+		brelse(bh);
+	}
+	/* block 0 is the dummy block, never file data */
+	if (!blk) {
+		printk(KERN_ERR "HUST: inode [%lu] has a hole at block %llu\n",
+		       inode->i_ino, lblk);
+		return -EIO;
+	}
+	*pblk = blk;
+	return 0;
+}
+
+/*
+ * Logical blocks @from to @to - 1 of @inode were allocated only to reach
+ * a later one and nothing is going to write them.  The block map has no
+ * holes, so zero them on disk: once i_size passes them they would show
+ * whatever they last held, possibly another file's data.  The zeroes go
+ * straight to the device before the handle that maps them can commit.
+ */
+static int HUST_fs_zero_gap(struct inode *inode, uint64_t from, uint64_t to)
+{
+	struct super_block *sb = inode->i_sb;
+	uint64_t pblk, start = 0, len = 0;
+	int err = 0;
+
+	for (; from < to; from++) {
+		err = HUST_fs_bmap(inode, from, &pblk);
+		if (err)
+			return err;
+		if (len && pblk == start + len) {
+			len++;
+			continue;
+		}
+		if (len)
+			err = sb_issue_zeroout(sb, start, len, GFP_NOFS);
+		if (err)
+			return err;
+		start = pblk;
+		len = 1;
+	}
+	if (len)
+		err = sb_issue_zeroout(sb, start, len, GFP_NOFS);
+	return err;
+}
+
+/*
+ * Grow @inode up to and including @block, in one transaction per batch
+ * of blocks the journal can take at once.  Blocks before @block are
+ * zeroed.  Returns 1 if this call allocated @block itself.
+ */
+static int HUST_fs_extend(struct inode *inode, sector_t block)
+{
+	struct super_block *sb = inode->i_sb;
+	struct HUST_inode_info *hi = HUST_I(inode);
+	uint64_t batch = HUST_journal_max_alloc(sb), want;
+	handle_t *handle;
+	int ret, err, new, done;
+
+	do {
+		/* a racy guess for the credits, checked under the mutex */
+		want = block >= READ_ONCE(hi->blocks) ?
+		    min_t(uint64_t, block + 1 - READ_ONCE(hi->blocks), batch) : 1;
+		handle = HUST_journal_start(sb, HUST_journal_alloc_credits(sb, want));
+		if (IS_ERR(handle))
+			return PTR_ERR(handle);
+		ret = new = 0;
+		mutex_lock(&hi->alloc_mutex);
+		if (block >= hi->blocks) {
+			uint64_t old = hi->blocks;
+
+			ret = alloc_block_for_inode(inode,
+				min_t(uint64_t, block + 1 - hi->blocks, want));
+			new = !ret && block < hi->blocks;
+			/*
+			 * The caller writes @block itself.  A failed batch
+			 * may still have mapped some of the others.
+			 */
+			err = HUST_fs_zero_gap(inode, old,
+					min_t(uint64_t, hi->blocks, block));
+			if (!ret)
+				ret = err;
+		}
+		done = ret || block < hi->blocks;
+		mutex_unlock(&hi->alloc_mutex);
+		/* logs the grown block map with the bitmap */
+		mark_inode_dirty(inode);
+		HUST_journal_stop(handle);
+	} while (!done);
+	return ret ? ret : new;
 }
+
 int HUST_fs_get_block(struct inode *inode, sector_t block,
 		      struct buffer_head *bh, int create)
 {
 	struct super_block *sb = inode->i_sb;
-	
-	printk(KERN_INFO "HUST: get block [%lu] of inode [%llu]\n", block,
-	       inode->i_ino);
-	if (block > HUST_N_BLOCKS) {
-		return -ENOSPC;
+	struct HUST_inode_info *hi = HUST_I(inode);
+	u64 start = ktime_get_ns();
+	uint64_t phys = 0;
+	int ret = 0;
+
+	if (block >= HUST_fs_max_blocks(sb)) {
+		ret = -ENOSPC;
+		goto out;
+	}
+	if (create && block >= READ_ONCE(hi->blocks)) {
+		ret = HUST_fs_extend(inode, block);
+		if (ret < 0)
+			goto out;
+		if (ret)
+			set_buffer_new(bh);
+		ret = 0;
+	}
+	mutex_lock(&hi->alloc_mutex);
+	if (block < hi->blocks) {
+		ret = HUST_fs_bmap(inode, block, &phys);
+		if (!ret)
+			map_bh(bh, sb, phys);
+	}
+	mutex_unlock(&hi->alloc_mutex);
+ out:
+	trace_get_block(inode, block, create, phys, ret);
+	HUST_stat_latency(sb, HUST_LAT_GET_BLOCK, start);
+	return ret;
+}
+
+/*
+ * Mark the bits of @bmap from @nbits to the end of its last long as used,
+ * so no search returns them, or back as they were on disk (clear) before
+ * the bitmap is saved.
+ */
+static void HUST_fs_pad_bmap(uint8_t *bmap, uint64_t nbits, bool used)
+{
+	uint64_t i, end = (uint64_t)BITS_TO_LONGS(nbits) * BITS_PER_LONG;
+
+	for (i = nbits; i < end; i++) {
+		if (used)
+			setbit(bmap[i/8], i%8);
+		else
+			clearbit(bmap[i/8], i%8);
 	}
-	struct HUST_inode H_inode;
-	if (-1 == HUST_fs_get_inode(sb, inode->i_ino, &H_inode))
-		return -EFAULT;
-	if (H_inode.blocks == 0){
-        if(alloc_block_for_inode(sb, &H_inode, 1)) {
-            return -EFAULT;
-        }
-    }
-    mark_inode_dirty(inode);
-	map_bh(bh, sb, H_inode.block[0]);
-	return 0;
 }
 
-int alloc_block_for_inode(struct super_block* sb, struct HUST_inode* p_H_inode, ssize_t size)
+/*
+ * Take the first free block in @bmap at or after @goal, wrapping around
+ * to the start, or return 0 if there is none.  @goal 0 is first fit.
+ */
+static uint64_t HUST_fs_take_block(struct super_block *sb, uint8_t *bmap,
+				   uint64_t nbits, uint64_t goal)
 {
+	uint64_t nr = nbits, scanned = 0;
+
+	if (goal && goal < nbits) {
+		nr = find_next_zero_bit_le(bmap, nbits, goal);
+		scanned = min(nr + 1, nbits) - goal;
+	}
+	if (nr >= nbits) {
+		nr = HUST_find_first_zero_bit(bmap, nbits);
+		scanned += min(nr + 1, nbits);
+	}
+	HUST_stat_inc(sb, HUST_STAT_BITMAP_SCANS);
+	HUST_stat_add(sb, HUST_STAT_BITS_SCANNED, scanned);
+	if (nr >= nbits)
+		return 0;
+	setbit(bmap[nr/8], nr%8);
+	return nr;
+}
+
+/*
+ * Buffer for the just allocated metadata block @blk, zeroed and known to
+ * the journal as new.  The caller fills it in and dirties it.
+ */
+struct buffer_head *HUST_fs_getblk_new(struct super_block *sb, uint64_t blk)
+{
+	struct buffer_head *bh;
+	int err;
+
+	bh = sb_getblk(sb, blk);
+	if (!bh)
+		return ERR_PTR(-EIO);
+	lock_buffer(bh);
+	err = HUST_journal_get_create_access(sb, bh);
+	if (err) {
+		unlock_buffer(bh);
+		brelse(bh);
+		return ERR_PTR(err);
+	}
+	memset(bh->b_data, 0, HUST_BLOCK_SIZE(sb));
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	return bh;
+}
+
+/* Store @blk in @slot of the indirect block @bh, or of block[] if NULL. */
+static int HUST_fs_set_slot(struct inode *inode, struct buffer_head *bh,
+			    uint64_t *slot, uint64_t blk)
+{
+	int err;
+
+	if (!bh) {
+		*slot = blk;
+		return 0;
+	}
+	err = HUST_journal_get_write_access(inode->i_sb, bh);
+	if (err)
+		return err;
+	*slot = blk;
+	return HUST_journal_dirty_inode_buffer(inode, bh);
+}
+
+/*
+ * Point logical block @lblk at @pblk, taking any missing indirect blocks
+ * from @bmap of @nbits blocks.  *@meta counts the indirect blocks taken.
+ */
+static int HUST_fs_set_bmap(struct inode *inode, uint64_t lblk, uint64_t pblk,
+			    uint8_t *bmap, uint64_t nbits, uint64_t *meta)
+{
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bh = NULL, *nbh;
+	unsigned int path[3];
+	uint64_t *slot, blk;
+	int depth, i, err = 0;
+
+	depth = HUST_fs_block_path(sb, lblk, path);
+	slot = &HUST_I(inode)->block[path[0]];
+	for (i = 1; i < depth; i++) {
+		blk = *slot;
+		if (blk) {
+			nbh = HUST_sb_bread(sb, blk);
+			if (!nbh)
+				err = -EIO;
+		} else {
+			/* with alloc=goal right behind the data block */
+			blk = HUST_fs_take_block(sb, bmap, nbits,
+				HUST_test_opt(sb, ALLOC_GOAL) ? pblk + 1 : 0);
+			if (!blk) {
+				brelse(bh);
+				return -ENOSPC;
+			}
+			(*meta)++;
+			nbh = HUST_fs_getblk_new(sb, blk);
+			if (IS_ERR(nbh)) {
+				err = PTR_ERR(nbh);
+				nbh = NULL;
+			} else {
+				err = HUST_journal_dirty_inode_buffer(inode, nbh);
+				if (!err)
+					err = HUST_fs_set_slot(inode, bh, slot, blk);
+			}
+		}
+		brelse(bh);
+		if (err) {
+			brelse(nbh);
+			return err;
+		}
+		bh = nbh;
+		slot = (uint64_t *)bh->b_data + path[i];
+	}
+	err = HUST_fs_set_slot(inode, bh, slot, pblk);
+	brelse(bh);
+	return err;
+}
+
+/*
+ * Caller holds HUST_I(inode)->alloc_mutex, inside a handle with
+ * HUST_journal_alloc_credits(@nr_blocks), and marks the inode dirty
+ * once the mutex is dropped.
+ */
+int alloc_block_for_inode(struct inode *inode, ssize_t nr_blocks)
+{
+    struct super_block *sb = inode->i_sb;
+    struct HUST_inode_info *hi = HUST_I(inode);
+    struct HUST_sb_info *sbi = HUST_SB(sb);
     struct HUST_fs_super_block* disk_sb;
     ssize_t bmap_size;
     uint8_t* bmap;
-    unsigned int i;
-    
-    ssize_t alloc_blocks = size - p_H_inode->blocks;
-    if(size + p_H_inode->blocks > HUST_N_BLOCKS){
+    uint64_t meta = 0, goal = 0, nbits, first = 0;
+    ssize_t i;
+    int ret = 0, err;
+
+    disk_sb = sbi->s_disk;
+    if(hi->blocks + nr_blocks > HUST_fs_max_blocks(sb) ||
+       percpu_counter_read_positive(&sbi->s_freeblocks_counter) < nr_blocks){
+        HUST_stat_inc(sb, HUST_STAT_ALLOC_FAIL);
         return -ENOSPC;
     }
-    //read bmap
-    disk_sb = sb->s_fs_info;
-    bmap_size = disk_sb->blocks_count/8;
-    bmap = kmalloc(bmap_size, GFP_KERNEL);
-    
+    /*
+     * The bitmap is copied, searched and written back whole, so no
+     * other allocation may run in between.
+     */
+    mutex_lock(&sbi->s_bmap_mutex);
+    nbits = disk_sb->blocks_count;
+    bmap_size = DIV_ROUND_UP(nbits, 8);
+    /* whole longs for find_next_zero_bit_le(), see HUST_fs_pad_bmap() */
+    bmap = kvmalloc(BITS_TO_LONGS(nbits) * sizeof(long), GFP_KERNEL);
+    if(!bmap) {
+        mutex_unlock(&sbi->s_bmap_mutex);
+        HUST_stat_inc(sb, HUST_STAT_ALLOC_FAIL);
+        return -ENOMEM;
+    }
+
     if(get_bmap(sb, bmap, bmap_size))
     {
-        kfree(bmap);
+        kvfree(bmap);
+        mutex_unlock(&sbi->s_bmap_mutex);
+        HUST_stat_inc(sb, HUST_STAT_ALLOC_FAIL);
         return -EFAULT;
     }
-    
-    for(i = 0; i < alloc_blocks; ++i) {
-        uint64_t empty_blk_num = HUST_find_first_zero_bit(bmap, disk_sb->blocks_count / 8);
-        p_H_inode->block[p_H_inode->blocks] = empty_blk_num;
-        p_H_inode->blocks++;
-        uint64_t bit_off = empty_blk_num % (HUST_BLOCKSIZE*8);
-        setbit(bmap[bit_off/8], bit_off%8);
+    HUST_fs_pad_bmap(bmap, nbits, true);
+    /* alloc=goal: continue where the file ends, for long runs */
+    if(HUST_test_opt(sb, ALLOC_GOAL) && hi->blocks &&
+       !HUST_fs_bmap(inode, hi->blocks - 1, &goal))
+        goal++;
+
+    for(i = 0; i < nr_blocks; ++i) {
+        uint64_t empty_blk_num = HUST_fs_take_block(sb, bmap, nbits, goal);
+        if(!empty_blk_num) {
+            ret = -ENOSPC;
+            break;
+        }
+        ret = HUST_fs_set_bmap(inode, hi->blocks, empty_blk_num, bmap, nbits,
+                               &meta);
+        if(ret) {
+            clearbit(bmap[empty_blk_num/8], empty_blk_num%8);
+            break;
+        }
+        hi->blocks++;
+        if(!first)
+            first = empty_blk_num;
+        if(HUST_test_opt(sb, ALLOC_GOAL))
+            goal = empty_blk_num + 1;
     }
-    save_bmap(sb,bmap,bmap_size);
-    save_inode(sb,*p_H_inode);
-    disk_sb->free_blocks -= size;
-    kfree(bmap);
-    return 0;
+    HUST_fs_pad_bmap(bmap, nbits, false);
+    err = save_bmap(sb,bmap,bmap_size,inode);
+    percpu_counter_sub(&sbi->s_freeblocks_counter, i + meta);
+    mutex_unlock(&sbi->s_bmap_mutex);
+    HUST_fs_super_changed(sb);
+    inode->i_blocks = hi->blocks * (HUST_BLOCK_SIZE(sb) >> 9);
+    kvfree(bmap);
+    if(!ret)
+        ret = err;
+    HUST_stat_inc(sb, ret ? HUST_STAT_ALLOC_FAIL : HUST_STAT_ALLOC_OK);
+    trace_alloc(inode, nr_blocks, i, meta, first, ret);
+    return ret;
 }
 
+int HUST_fs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+		   u64 start, u64 len)
+{
+	/*
+	 * Walk the block map and report each run of physically adjacent
+	 * blocks as a single extent, so filefrag sees the real
+	 * fragmentation.
+	 */
+	struct HUST_inode_info *hi = HUST_I(inode);
+	u64 bsize = HUST_BLOCK_SIZE(inode->i_sb);
+	uint64_t i, ext_start, ext_phys, next = 0, first, last, nr_blocks;
+	u32 flags;
+	int ret;
+
+	ret = fiemap_check_flags(fieinfo, FIEMAP_FLAG_SYNC);
+	if (ret)
+		return ret;
+
+	/*
+	 * Only the length is taken under the lock: filling extents may
+	 * fault on our own pages, and blocks below it never move.
+	 */
+	mutex_lock(&hi->alloc_mutex);
+	nr_blocks = hi->blocks;
+	mutex_unlock(&hi->alloc_mutex);
+
+	if (len > U64_MAX - start)
+		len = U64_MAX - start;
+	if (len == 0)
+		return 0;
+	first = start / bsize;
+	last = (start + len - 1) / bsize;
+
+	i = first;
+	if (i < nr_blocks)
+		ret = HUST_fs_bmap(inode, i, &next);
+	while (!ret && i < nr_blocks && i <= last) {
+		ext_start = i;
+		ext_phys = next;
+		for (i++; i < nr_blocks; i++) {
+			ret = HUST_fs_bmap(inode, i, &next);
+			if (ret || next != ext_phys + (i - ext_start))
+				break;
+		}
+		if (ret)
+			break;
+		flags = (i == nr_blocks) ? FIEMAP_EXTENT_LAST : 0;
+		ret = fiemap_fill_next_extent(fieinfo,
+				ext_start * bsize, ext_phys * bsize,
+				(i - ext_start) * bsize, flags);
+	}
+	/* 1 means the user buffer is full, which is not an error */
+	return ret < 0 ? ret : 0;
+}
@@ -2,11 +2,75 @@
 #define CONSTANT_H
 
 #define MAGIC_NUM 1314522
-#define HUST_BLOCKSIZE 4096
+#define HUST_BLOCKSIZE 4096 //mkfs default; the superblock is read in this unit
+#define HUST_MIN_BLOCKSIZE 1024
+#define HUST_MAX_BLOCKSIZE 65536
 #define HUST_N_BLOCKS 10
 #define HUST_INODE_TABLE_START_IDX 4
 #define HUST_ROOT_INODE_NUM 0
 #define HUST_FILENAME_MAX_LEN 256
-#define RESERVE_BLOCKS 2 //dummy and sb
+#define HUST_SB_OFFSET 4096 //bytes before the superblock, at any block size
+#define RESERVE_BLOCKS(bs) ((2*HUST_SB_OFFSET + (bs) - 1)/(bs)) //dummy and sb
+
+#define HUST_VERSION_1 1 //264-byte inodes
+#define HUST_VERSION_2 2 //128-byte packed inodes
+#define HUST_INODE_V2_SIZE 128
+
+//superblock feature bits
+#define HUST_FEATURE_GROUPS 0x1 //group descriptor table after the sb
+#define HUST_FEATURE_DIR_INDEX 0x2 //large directories get a hashed index
+#define HUST_FEATURE_INDIRECT 0x4 //block[8] and block[9] are indirect blocks
+#define HUST_FEATURE_VARDIR 0x8 //variable-length directory entries
+#define HUST_FEATURE_JOURNAL 0x10 //metadata journal at journal_block
+#define HUST_FEATURE_SUPP (HUST_FEATURE_GROUPS | HUST_FEATURE_DIR_INDEX | \
+			   HUST_FEATURE_INDIRECT | HUST_FEATURE_VARDIR | \
+			   HUST_FEATURE_JOURNAL)
+
+//block map with HUST_FEATURE_INDIRECT
+#define HUST_NDIR_BLOCKS 8
+#define HUST_IND_BLOCK 8
+#define HUST_DIND_BLOCK 9
+
+//inode flags
+#define HUST_INDEX_FL 0x1 //directory block 0 is a hashed index root
+
+//file_type of a variable-length directory entry
+#define HUST_FT_UNKNOWN 0
+#define HUST_FT_REG_FILE 1
+#define HUST_FT_DIR 2
+#define HUST_FT_CHRDEV 3
+#define HUST_FT_BLKDEV 4
+#define HUST_FT_FIFO 5
+#define HUST_FT_SOCK 6
+#define HUST_FT_SYMLINK 7
+#define HUST_FT_MAX 8
+
+//hashed directory index
+#define HUST_DX_MAGIC 0x48445831 //"HDX1"
+#define HUST_DX_MAX_LEVELS 1 //index node levels below the root
+#define HUST_DX_EOF_64 (1ULL << 32) //readdir position past every name hash
+#define HUST_DX_EOF_32 0x7fffffff //the same for 32-bit callers
+
+//ioctls, on any file or directory of the file system
+#define HUST_IOC_RESIZE _IOWR('H', 1, uint64_t) //grow to this many blocks, returns the count used
+#define HUST_GROW_ALIGN 64 //grown block counts are rounded down to a multiple
+
+//superblock state
+#define HUST_STATE_CLEAN 0x1 //unmounted cleanly, free counts are exact
+#define HUST_MOUNT_BITMAP_RA 16 //bitmap blocks read ahead at a clean mount
+
+//group descriptor flags
+#define HUST_BG_ITABLE_UNINIT 0x1 //inode table not zeroed yet
+#define HUST_ITABLE_INIT_DELAY_MS 100 //pause between lazily zeroed groups
+#define HUST_DEFAULT_INODE_RATIO 16384 //mkfs bytes per inode
+#define HUST_INODE_READAHEAD_BLKS 8 //table blocks read with a cold one
+#define HUST_INODE_READAHEAD_MAX 1024
+#define HUST_DEFAULT_COMMIT_SECS 5 //journal commits, free counts to the sb
+#define HUST_DIRCACHE_MIN_BLOCKS 2 //smallest directory given a name cache
+#define HUST_LAT_BUCKETS 32 //log2 latency buckets, the last is 1s and up
+
+//metadata journal, a jbd2 log inside the file system
+#define HUST_JOURNAL_MIN_BLOCKS 1024 //JBD2_MIN_JOURNAL_BLOCKS
+#define HUST_JOURNAL_MAX_BLOCKS 32768 //mkfs default is 1/64 of the disk
 
 #endif
@@ -0,0 +1,952 @@
+#include "constants.h"
+#include "HUST_fs.h"
+#include <linux/sort.h>
+#include <linux/compat.h>
+
+/*
+ * Directory entries.
+ *
+ * A directory is a list of leaf blocks of records.  With
+ * HUST_FEATURE_VARDIR those are variable-length HUST_dir_entry records
+ * chained by rec_len, so a block holds as many names as fit; older file
+ * systems use fixed HUST_dir_record slots, free when the name starts
+ * with '\0'.  Everything above the HUST_leaf_* helpers is the same for
+ * both formats.
+ *
+ * A small directory is one leaf and is searched linearly.  When that
+ * block fills up on a file system with HUST_FEATURE_DIR_INDEX, the
+ * directory is turned into a hashed index (HUST_INDEX_FL): block 0
+ * becomes the root of a tree of (hash, block) pairs, at most
+ * HUST_DX_MAX_LEVELS node levels deep, whose leaves each hold one range
+ * of name hashes.  A lookup then reads the root, at most one node and
+ * one leaf, whatever the size of the directory.
+ *
+ * Records with the same hash are never split over two leaves, so the
+ * leaf the index points at is the only one that can hold a name.
+ *
+ * Callers hold the directory's i_rwsem and a journal handle for any
+ * change.
+ */
+
+#define HUST_SLOTS_PER_BLOCK(dir) \
+	(HUST_BLOCK_SIZE((dir)->i_sb) / sizeof(struct HUST_dir_record))
+
+static int HUST_dir_vardir(struct inode *dir)
+{
+	return HUST_SB(dir->i_sb)->s_disk->features & HUST_FEATURE_VARDIR;
+}
+
+static const unsigned char HUST_type_by_mode[S_IFMT >> 12] = {
+	[S_IFREG >> 12]		= HUST_FT_REG_FILE,
+	[S_IFDIR >> 12]		= HUST_FT_DIR,
+	[S_IFCHR >> 12]		= HUST_FT_CHRDEV,
+	[S_IFBLK >> 12]		= HUST_FT_BLKDEV,
+	[S_IFIFO >> 12]		= HUST_FT_FIFO,
+	[S_IFSOCK >> 12]	= HUST_FT_SOCK,
+	[S_IFLNK >> 12]		= HUST_FT_SYMLINK,
+};
+
+static const unsigned char HUST_dtype_by_ft[HUST_FT_MAX] = {
+	[HUST_FT_UNKNOWN]	= DT_UNKNOWN,
+	[HUST_FT_REG_FILE]	= DT_REG,
+	[HUST_FT_DIR]		= DT_DIR,
+	[HUST_FT_CHRDEV]	= DT_CHR,
+	[HUST_FT_BLKDEV]	= DT_BLK,
+	[HUST_FT_FIFO]		= DT_FIFO,
+	[HUST_FT_SOCK]		= DT_SOCK,
+	[HUST_FT_SYMLINK]	= DT_LNK,
+};
+
+/* d_type for readdir; fixed-size records carry no type and say DT_UNKNOWN */
+unsigned char HUST_dir_dtype(const struct HUST_dirent *de)
+{
+	return de->file_type < HUST_FT_MAX ?
+	    HUST_dtype_by_ft[de->file_type] : DT_UNKNOWN;
+}
+
+/* FNV-1a: byte at a time, so the on-disk order is the same on any cpu */
+uint32_t HUST_dir_hash(const char *name, unsigned int len)
+{
+	uint32_t hash = 2166136261u;
+
+	while (len--) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+int HUST_dir_is_index(const void *data)
+{
+	const struct HUST_dx_header *hdr = data;
+
+	return hdr->fake_inode == 0 && hdr->fake_name_len == 0 &&
+	    hdr->magic == HUST_DX_MAGIC;
+}
+
+struct buffer_head *HUST_dir_bread(struct inode *dir, uint64_t lblk)
+{
+	uint64_t phys;
+
+	if (lblk >= HUST_I(dir)->blocks)
+		return NULL;
+	if (HUST_fs_bmap(dir, lblk, &phys))
+		return NULL;
+	return HUST_sb_bread(dir->i_sb, phys);
+}
+
+static void HUST_leaf_init(struct inode *dir, void *data)
+{
+	memset(data, 0, HUST_BLOCK_SIZE(dir->i_sb));
+	if (HUST_dir_vardir(dir))
+		HUST_set_rec_len(data, HUST_BLOCK_SIZE(dir->i_sb));
+}
+
+/* Append an empty leaf to @dir; its number is returned in @lblk. */
+static struct buffer_head *HUST_dir_new_block(struct inode *dir, uint64_t *lblk)
+{
+	struct HUST_inode_info *hi = HUST_I(dir);
+	struct buffer_head *bh;
+	uint64_t phys;
+	int err;
+
+	mutex_lock(&hi->alloc_mutex);
+	err = alloc_block_for_inode(dir, 1);
+	if (!err) {
+		*lblk = hi->blocks - 1;
+		err = HUST_fs_bmap(dir, *lblk, &phys);
+	}
+	mutex_unlock(&hi->alloc_mutex);
+	mark_inode_dirty(dir);
+	if (err)
+		return ERR_PTR(err);
+
+	bh = HUST_fs_getblk_new(dir->i_sb, phys);
+	if (IS_ERR(bh))
+		return bh;
+	lock_buffer(bh);
+	HUST_leaf_init(dir, bh->b_data);
+	unlock_buffer(bh);
+	err = HUST_journal_dirty_inode_buffer(dir, bh);
+	if (err) {
+		brelse(bh);
+		return ERR_PTR(err);
+	}
+	return bh;
+}
+
+static int HUST_dir_entry_ok(struct inode *dir, const struct HUST_dir_entry *e,
+			     unsigned int offset)
+{
+	unsigned int bsize = HUST_BLOCK_SIZE(dir->i_sb);
+
+	if (offset + HUST_DIR_ENTRY_HDR <= bsize &&
+	    !(HUST_rec_len(e) & 7) &&
+	    HUST_rec_len(e) >= HUST_DIR_REC_LEN(e->name_len) &&
+	    offset + HUST_rec_len(e) <= bsize)
+		return 1;
+	printk(KERN_ERR "HUST_fs: bad entry at offset %u in directory [%lu]\n",
+	       offset, dir->i_ino);
+	return 0;
+}
+
+/*
+ * Find the first used record at or after @offset in the leaf @data.
+ * Returns 1 with @de filled in, 0 at the end of the block, or -EIO.
+ */
+int HUST_dir_leaf_next(struct inode *dir, void *data, unsigned int offset,
+		       struct HUST_dirent *de)
+{
+	if (!HUST_dir_vardir(dir)) {
+		unsigned int slot = DIV_ROUND_UP(offset,
+					sizeof(struct HUST_dir_record));
+
+		for (; slot < HUST_SLOTS_PER_BLOCK(dir); slot++) {
+			struct HUST_dir_record *rec =
+			    (struct HUST_dir_record *)data + slot;
+
+			if (!rec->filename[0])
+				continue;
+			de->name = rec->filename;
+			de->name_len = strnlen(rec->filename,
+					       HUST_FILENAME_MAX_LEN - 1);
+			de->file_type = 0;
+			de->inode_no = rec->inode_no;
+			de->offset = slot * sizeof(*rec);
+			de->next = de->offset + sizeof(*rec);
+			return 1;
+		}
+		return 0;
+	}
+
+	while (offset < HUST_BLOCK_SIZE(dir->i_sb)) {
+		struct HUST_dir_entry *e = data + offset;
+
+		if (!HUST_dir_entry_ok(dir, e, offset))
+			return -EIO;
+		if (e->name_len) {
+			de->name = e->name;
+			de->name_len = e->name_len;
+			de->file_type = e->file_type;
+			de->inode_no = e->inode_no;
+			de->offset = offset;
+			de->next = offset + HUST_rec_len(e);
+			return 1;
+		}
+		offset += HUST_rec_len(e);
+	}
+	return 0;
+}
+
+/*
+ * First record boundary at or after @offset.  A saved readdir position
+ * may point into the middle of a record once the block has changed.
+ */
+unsigned int HUST_dir_leaf_validate(struct inode *dir, void *data,
+				    unsigned int offset)
+{
+	unsigned int pos = 0;
+
+	if (!HUST_dir_vardir(dir))
+		return offset;
+	while (pos < offset) {
+		struct HUST_dir_entry *e = data + pos;
+
+		if (!HUST_dir_entry_ok(dir, e, pos))
+			return HUST_BLOCK_SIZE(dir->i_sb);
+		pos += HUST_rec_len(e);
+	}
+	return pos;
+}
+
+static int HUST_leaf_find(struct inode *dir, void *data, const char *name,
+			  unsigned int len, struct HUST_dirent *de)
+{
+	unsigned int offset = 0, scanned = 0;
+	int ret;
+
+	while ((ret = HUST_dir_leaf_next(dir, data, offset, de)) > 0) {
+		scanned++;
+		if (de->name_len == len && !memcmp(de->name, name, len)) {
+			ret = 1;
+			break;
+		}
+		offset = de->next;
+	}
+	HUST_stat_add(dir->i_sb, HUST_STAT_DIRENTS_SCANNED, scanned);
+	return ret;
+}
+
+static int HUST_leaf_add(struct inode *dir, void *data, const char *name,
+			 unsigned int len, uint64_t inode_no,
+			 unsigned int file_type)
+{
+	unsigned int offset, need = HUST_DIR_REC_LEN(len);
+
+	if (!HUST_dir_vardir(dir)) {
+		struct HUST_dir_record *rec = data;
+		int i;
+
+		if (len >= HUST_FILENAME_MAX_LEN)
+			return -ENAMETOOLONG;
+		for (i = 0; i < HUST_SLOTS_PER_BLOCK(dir); i++, rec++) {
+			if (rec->filename[0])
+				continue;
+			memset(rec, 0, sizeof(*rec));
+			memcpy(rec->filename, name, len);
+			rec->inode_no = inode_no;
+			return 0;
+		}
+		return -ENOSPC;
+	}
+
+	if (len > 255)
+		return -ENAMETOOLONG;
+	for (offset = 0; offset < HUST_BLOCK_SIZE(dir->i_sb); ) {
+		struct HUST_dir_entry *e = data + offset;
+		unsigned int used;
+
+		if (!HUST_dir_entry_ok(dir, e, offset))
+			return -EIO;
+		used = e->name_len ? HUST_DIR_REC_LEN(e->name_len) : 0;
+		if (HUST_rec_len(e) - used >= need) {
+			/* take the unused tail of this record */
+			if (used) {
+				struct HUST_dir_entry *n = data + offset + used;
+
+				HUST_set_rec_len(n, HUST_rec_len(e) - used);
+				HUST_set_rec_len(e, used);
+				e = n;
+			}
+			e->inode_no = inode_no;
+			e->name_len = len;
+			e->file_type = file_type;
+			memcpy(e->name, name, len);
+			return 0;
+		}
+		offset += HUST_rec_len(e);
+	}
+	return -ENOSPC;
+}
+
+/* Remove the record at @offset, found by HUST_dir_leaf_next(). */
+static void HUST_leaf_remove(struct inode *dir, void *data, unsigned int offset)
+{
+	struct HUST_dir_entry *e, *prev = NULL;
+	unsigned int pos;
+
+	if (!HUST_dir_vardir(dir)) {
+		memset(data + offset, 0, sizeof(struct HUST_dir_record));
+		return;
+	}
+
+	for (pos = 0; pos < offset; pos += HUST_rec_len(prev))
+		prev = data + pos;
+	e = data + offset;
+	if (prev) {
+		HUST_set_rec_len(prev, HUST_rec_len(prev) + HUST_rec_len(e));
+		return;
+	}
+	/* the first record stays as unused space; wipe the old name */
+	memset(e->name, 0, e->name_len);
+	e->inode_no = 0;
+	e->name_len = 0;
+	e->file_type = 0;
+}
+
+/*
+ * Remove the record @de found by HUST_dir_find_entry() from its block
+ * @bh.  Only that block is dirtied; the index never changes, an emptied
+ * leaf simply stays in place for later inserts.
+ */
+int HUST_dir_delete_entry(struct inode *dir, const struct HUST_dirent *de,
+			  struct buffer_head *bh)
+{
+	int err;
+
+	err = HUST_journal_get_write_access(dir->i_sb, bh);
+	if (err)
+		return err;
+	lock_buffer(bh);
+	HUST_leaf_remove(dir, bh->b_data, de->offset);
+	unlock_buffer(bh);
+	return HUST_journal_dirty_inode_buffer(dir, bh);
+}
+
+struct HUST_dx_map {
+	uint32_t hash;
+	uint16_t offset;
+};
+
+static int HUST_dx_map_cmp(const void *a, const void *b)
+{
+	const struct HUST_dx_map *x = a, *y = b;
+
+	if (x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+	return x->offset - y->offset;
+}
+
+/*
+ * Move the records of the full leaf @old with the higher hashes into the
+ * empty leaf @new.  The lowest hash that moved is returned in @split.
+ */
+static int HUST_leaf_split(struct inode *dir, void *old, void *new,
+			   uint32_t *split)
+{
+	unsigned int bsize = HUST_BLOCK_SIZE(dir->i_sb);
+	struct HUST_dx_map *map;
+	struct HUST_dirent de;
+	unsigned int offset = 0;
+	char *tmp;
+	int i, n = 0, mid, ret;
+
+	/* every record takes at least HUST_DIR_REC_LEN(1) bytes */
+	map = kvmalloc(bsize / HUST_DIR_REC_LEN(1) * sizeof(*map) + bsize,
+		       GFP_NOFS);
+	if (!map)
+		return -ENOMEM;
+	tmp = (char *)(map + bsize / HUST_DIR_REC_LEN(1));
+	memcpy(tmp, old, bsize);
+
+	while ((ret = HUST_dir_leaf_next(dir, tmp, offset, &de)) > 0) {
+		map[n].hash = HUST_dir_hash(de.name, de.name_len);
+		map[n].offset = de.offset;
+		n++;
+		offset = de.next;
+	}
+	if (ret < 0)
+		goto out;
+	ret = -ENOSPC;
+	if (n < 2)
+		goto out;
+	sort(map, n, sizeof(map[0]), HUST_dx_map_cmp, NULL);
+
+	/* keep equal hashes together, on whichever side is closer */
+	mid = n / 2;
+	while (mid < n && map[mid].hash == map[mid - 1].hash)
+		mid++;
+	if (mid == n) {
+		mid = n / 2;
+		while (mid > 0 && map[mid].hash == map[mid - 1].hash)
+			mid--;
+	}
+	if (mid == 0)
+		goto out;
+
+	HUST_leaf_init(dir, old);
+	for (i = 0; i < n; i++) {
+		HUST_dir_leaf_next(dir, tmp, map[i].offset, &de);
+		HUST_leaf_add(dir, i < mid ? old : new, de.name, de.name_len,
+			      de.inode_no, de.file_type);
+	}
+	*split = map[mid].hash;
+	ret = 0;
+ out:
+	kvfree(map);
+	return ret;
+}
+
+struct HUST_dx_frame {
+	struct buffer_head *bh;
+	struct HUST_dx_entry *at;
+};
+
+static struct HUST_dx_entry *HUST_dx_entries(struct buffer_head *bh)
+{
+	return (struct HUST_dx_entry *)(bh->b_data + sizeof(struct HUST_dx_header));
+}
+
+static void HUST_dx_release(struct HUST_dx_frame *frames, int nframes)
+{
+	while (nframes--)
+		brelse(frames[nframes].bh);
+}
+
+/*
+ * Walk from the root towards the leaf covering @hash.  frames[0] is the
+ * root; the last frame's ->at names the leaf.  Returns the frame count.
+ */
+static int HUST_dx_probe(struct inode *dir, uint32_t hash,
+			 struct HUST_dx_frame *frames)
+{
+	struct HUST_dx_header *hdr;
+	struct HUST_dx_entry *entries;
+	struct buffer_head *bh;
+	unsigned int levels = 0, level, lo, hi;
+
+	bh = HUST_dir_bread(dir, 0);
+	for (level = 0; ; level++) {
+		if (!bh)
+			goto corrupt;
+		hdr = (struct HUST_dx_header *)bh->b_data;
+		if (!HUST_dir_is_index(hdr) || !hdr->count ||
+		    hdr->count > hdr->limit || hdr->limit > HUST_DX_LIMIT(dir->i_sb)) {
+			brelse(bh);
+			goto corrupt;
+		}
+		if (level == 0) {
+			levels = hdr->levels;
+			if (levels > HUST_DX_MAX_LEVELS) {
+				brelse(bh);
+				goto corrupt;
+			}
+		}
+
+		/* last entry whose hash is <= @hash; entries[0] has no bound */
+		entries = HUST_dx_entries(bh);
+		lo = 1;
+		hi = hdr->count;
+		while (lo < hi) {
+			unsigned int m = (lo + hi) / 2;
+
+			if (entries[m].hash > hash)
+				hi = m;
+			else
+				lo = m + 1;
+		}
+		frames[level].bh = bh;
+		frames[level].at = &entries[lo - 1];
+		if (level == levels)
+			return level + 1;
+		bh = HUST_dir_bread(dir, frames[level].at->block);
+	}
+
+ corrupt:
+	printk(KERN_ERR "HUST_fs: bad directory index in inode [%lu]\n",
+	       dir->i_ino);
+	HUST_dx_release(frames, level);
+	return -EIO;
+}
+
+static int HUST_dx_find_entry(struct inode *dir, const struct qstr *name,
+			      struct HUST_dirent *de,
+			      struct buffer_head **res_bh)
+{
+	struct HUST_dx_frame frames[HUST_DX_MAX_LEVELS + 1];
+	struct buffer_head *bh;
+	int nframes, ret;
+
+	nframes = HUST_dx_probe(dir, HUST_dir_hash(name->name, name->len), frames);
+	if (nframes < 0)
+		return nframes;
+	bh = HUST_dir_bread(dir, frames[nframes - 1].at->block);
+	HUST_dx_release(frames, nframes);
+	if (!bh)
+		return -EIO;
+
+	ret = HUST_leaf_find(dir, bh->b_data, name->name, name->len, de);
+	if (ret <= 0) {
+		brelse(bh);
+		return ret ? ret : -ENOENT;
+	}
+	*res_bh = bh;
+	return 0;
+}
+
+/* First hash past the leaf the last frame points at, 2^32 after the last. */
+static uint64_t HUST_dx_next_hash(struct HUST_dx_frame *frames, int nframes)
+{
+	while (nframes--) {
+		struct HUST_dx_frame *f = &frames[nframes];
+		struct HUST_dx_header *hdr = (struct HUST_dx_header *)f->bh->b_data;
+
+		if (f->at + 1 < HUST_dx_entries(f->bh) + hdr->count)
+			return f->at[1].hash;
+	}
+	return HUST_DX_EOF_64;
+}
+
+/*
+ * readdir positions in an indexed directory are name hashes: leaves are
+ * listed in hash order and each record in a leaf sorted by hash, so a
+ * listing resumes at the right name however the leaves were split or
+ * repacked since.  32-bit callers get hash / 2, as their positions stop
+ * at 2^31.  Names sharing a position can be listed twice when a getdents
+ * buffer fills up between them, and a stream begun while the directory
+ * was a single linear block starts over once it becomes an index.
+ */
+static bool HUST_dx_32bit(struct file *filp)
+{
+	if (filp->f_mode & FMODE_32BITHASH)
+		return true;
+	if (filp->f_mode & FMODE_64BITHASH)
+		return false;
+	return in_compat_syscall() || BITS_PER_LONG == 32;
+}
+
+static loff_t HUST_dx_eof(struct file *filp)
+{
+	return HUST_dx_32bit(filp) ? HUST_DX_EOF_32 : HUST_DX_EOF_64;
+}
+
+static loff_t HUST_dx_hash2pos(struct file *filp, uint64_t hash)
+{
+	if (hash >= HUST_DX_EOF_64)
+		return HUST_dx_eof(filp);
+	return HUST_dx_32bit(filp) ? hash >> 1 : hash;
+}
+
+int HUST_dx_readdir(struct file *filp, struct dir_context *ctx)
+{
+	struct inode *dir = file_inode(filp);
+	unsigned int bsize = HUST_BLOCK_SIZE(dir->i_sb);
+	struct HUST_dx_frame frames[HUST_DX_MAX_LEVELS + 1];
+	struct HUST_dx_map *map;
+	struct HUST_dirent de;
+	uint64_t hash, next, ra_last = 0;
+	unsigned int offset;
+	int nframes, n, i, ret = 0;
+
+	if (ctx->pos >= HUST_dx_eof(filp))
+		return 0;
+	hash = HUST_dx_32bit(filp) ? (uint64_t)ctx->pos << 1 : ctx->pos;
+	map = kvmalloc(bsize / HUST_DIR_REC_LEN(1) * sizeof(*map), GFP_KERNEL);
+	if (!map)
+		return -ENOMEM;
+
+	while (hash < HUST_DX_EOF_64) {
+		struct buffer_head *bh;
+
+		nframes = HUST_dx_probe(dir, hash, frames);
+		if (nframes < 0) {
+			ret = nframes;
+			break;
+		}
+		next = HUST_dx_next_hash(frames, nframes);
+		bh = HUST_dir_bread(dir, frames[nframes - 1].at->block);
+		HUST_dx_release(frames, nframes);
+		if (!bh || next <= hash) {
+			brelse(bh);
+			ret = -EIO;
+			break;
+		}
+
+		/* the leaf's records from @hash on, in hash order */
+		n = 0;
+		offset = 0;
+		while ((ret = HUST_dir_leaf_next(dir, bh->b_data, offset,
+						 &de)) > 0) {
+			uint32_t h = HUST_dir_hash(de.name, de.name_len);
+
+			if (h >= hash) {
+				map[n].hash = h;
+				map[n].offset = de.offset;
+				n++;
+			}
+			offset = de.next;
+		}
+		if (ret < 0) {
+			brelse(bh);
+			break;
+		}
+		sort(map, n, sizeof(map[0]), HUST_dx_map_cmp, NULL);
+		for (i = 0; i < n; i++) {
+			HUST_dir_leaf_next(dir, bh->b_data, map[i].offset, &de);
+			ctx->pos = HUST_dx_hash2pos(filp, map[i].hash);
+			if (!dir_emit(ctx, de.name, de.name_len, de.inode_no,
+				      HUST_dir_dtype(&de))) {
+				brelse(bh);
+				goto out;
+			}
+			HUST_fs_inode_readahead(dir->i_sb, de.inode_no, &ra_last);
+		}
+		brelse(bh);
+		hash = next;
+		ctx->pos = HUST_dx_hash2pos(filp, hash);
+	}
+ out:
+	kvfree(map);
+	return ret;
+}
+
+/* Hash positions of an indexed directory lie past its size. */
+loff_t HUST_dir_llseek(struct file *filp, loff_t offset, int whence)
+{
+	struct inode *dir = file_inode(filp);
+	loff_t max = HUST_I(dir)->i_flags & HUST_INDEX_FL ?
+	    HUST_dx_eof(filp) : dir->i_sb->s_maxbytes;
+
+	return generic_file_llseek_size(filp, offset, whence, max,
+					i_size_read(dir));
+}
+
+/*
+ * Look up @name in @dir.  On success @de describes the record, which
+ * lives in the buffer returned in @res_bh; -ENOENT if it is not there.
+ */
+int HUST_dir_find_entry(struct inode *dir, const struct qstr *name,
+			struct HUST_dirent *de, struct buffer_head **res_bh)
+{
+	struct HUST_inode_info *hi = HUST_I(dir);
+	struct buffer_head *bh;
+	uint64_t lblk;
+	int ret;
+
+	HUST_stat_inc(dir->i_sb, HUST_STAT_DIR_SEARCHES);
+	if (hi->i_flags & HUST_INDEX_FL)
+		return HUST_dx_find_entry(dir, name, de, res_bh);
+
+	for (lblk = 0; lblk < hi->blocks; lblk++) {
+		bh = HUST_dir_bread(dir, lblk);
+		if (!bh)
+			return -EIO;
+		ret = HUST_leaf_find(dir, bh->b_data, name->name, name->len, de);
+		if (ret > 0) {
+			*res_bh = bh;
+			return 0;
+		}
+		brelse(bh);
+		if (ret < 0)
+			return ret;
+	}
+	return -ENOENT;
+}
+
+static int HUST_dx_insert(struct inode *dir, struct buffer_head *bh,
+			  struct HUST_dx_entry *at, uint32_t hash, uint32_t block)
+{
+	struct HUST_dx_header *hdr = (struct HUST_dx_header *)bh->b_data;
+	struct HUST_dx_entry *end = HUST_dx_entries(bh) + hdr->count;
+	int err;
+
+	err = HUST_journal_get_write_access(dir->i_sb, bh);
+	if (err)
+		return err;
+	memmove(at + 2, at + 1, (end - (at + 1)) * sizeof(*at));
+	at[1].hash = hash;
+	at[1].block = block;
+	hdr->count++;
+	return HUST_journal_dirty_inode_buffer(dir, bh);
+}
+
+static void HUST_dx_init_node(struct inode *dir, struct buffer_head *bh,
+			      unsigned int levels)
+{
+	struct HUST_dx_header *hdr = (struct HUST_dx_header *)bh->b_data;
+
+	memset(hdr, 0, sizeof(*hdr));
+	if (HUST_dir_vardir(dir))
+		HUST_set_rec_len((struct HUST_dir_entry *)hdr,
+				 HUST_BLOCK_SIZE(dir->i_sb));
+	hdr->magic = HUST_DX_MAGIC;
+	hdr->limit = HUST_DX_LIMIT(dir->i_sb);
+	hdr->levels = levels;
+}
+
+/*
+ * The innermost index block on the path is full.  Either push the root's
+ * entries down into a new node or split the full node in two; the caller
+ * then probes again.
+ */
+static int HUST_dx_grow(struct inode *dir, struct HUST_dx_frame *frames,
+			int nframes)
+{
+	struct super_block *sb = dir->i_sb;
+	struct HUST_dx_header *root = (struct HUST_dx_header *)frames[0].bh->b_data;
+	struct HUST_dx_header *hdr, *nhdr;
+	struct buffer_head *nbh;
+	uint64_t nblk;
+	unsigned int half;
+	int err;
+
+	if (nframes == 1) {
+		if (root->levels >= HUST_DX_MAX_LEVELS)
+			return -ENOSPC;
+		err = HUST_journal_get_write_access(sb, frames[0].bh);
+		if (err)
+			return err;
+		nbh = HUST_dir_new_block(dir, &nblk);
+		if (IS_ERR(nbh))
+			return PTR_ERR(nbh);
+		HUST_dx_init_node(dir, nbh, 0);
+		nhdr = (struct HUST_dx_header *)nbh->b_data;
+		memcpy(HUST_dx_entries(nbh), HUST_dx_entries(frames[0].bh),
+		       root->count * sizeof(struct HUST_dx_entry));
+		nhdr->count = root->count;
+		err = HUST_journal_dirty_inode_buffer(dir, nbh);
+		brelse(nbh);
+		if (err)
+			return err;
+
+		root->levels++;
+		root->count = 1;
+		HUST_dx_entries(frames[0].bh)[0].hash = 0;
+		HUST_dx_entries(frames[0].bh)[0].block = nblk;
+		return HUST_journal_dirty_inode_buffer(dir, frames[0].bh);
+	}
+
+	if (root->count >= root->limit)
+		return -ENOSPC;
+	err = HUST_journal_get_write_access(sb, frames[1].bh);
+	if (err)
+		return err;
+	nbh = HUST_dir_new_block(dir, &nblk);
+	if (IS_ERR(nbh))
+		return PTR_ERR(nbh);
+	hdr = (struct HUST_dx_header *)frames[1].bh->b_data;
+	half = hdr->count / 2;
+	HUST_dx_init_node(dir, nbh, 0);
+	nhdr = (struct HUST_dx_header *)nbh->b_data;
+	nhdr->count = hdr->count - half;
+	memcpy(HUST_dx_entries(nbh), HUST_dx_entries(frames[1].bh) + half,
+	       nhdr->count * sizeof(struct HUST_dx_entry));
+	hdr->count = half;
+	err = HUST_journal_dirty_inode_buffer(dir, frames[1].bh);
+	if (!err)
+		err = HUST_dx_insert(dir, frames[0].bh, frames[0].at,
+				     HUST_dx_entries(nbh)[0].hash, nblk);
+	if (!err)
+		err = HUST_journal_dirty_inode_buffer(dir, nbh);
+	brelse(nbh);
+	return err;
+}
+
+static int HUST_dx_add_entry(struct inode *dir, const struct qstr *name,
+			     uint64_t inode_no, unsigned int file_type)
+{
+	struct HUST_dx_frame frames[HUST_DX_MAX_LEVELS + 1];
+	struct HUST_dx_header *hdr;
+	struct buffer_head *bh, *nbh;
+	uint32_t hash = HUST_dir_hash(name->name, name->len), split;
+	uint64_t nblk;
+	int nframes, err;
+
+ again:
+	nframes = HUST_dx_probe(dir, hash, frames);
+	if (nframes < 0)
+		return nframes;
+	bh = HUST_dir_bread(dir, frames[nframes - 1].at->block);
+	if (!bh) {
+		err = -EIO;
+		goto out;
+	}
+	err = HUST_journal_get_write_access(dir->i_sb, bh);
+	if (err)
+		goto release;
+	err = HUST_leaf_add(dir, bh->b_data, name->name, name->len,
+			    inode_no, file_type);
+	if (!err)
+		goto dirty;
+	if (err != -ENOSPC)
+		goto release;
+
+	/* the leaf is full: make room in its parent, then split it */
+	hdr = (struct HUST_dx_header *)frames[nframes - 1].bh->b_data;
+	if (hdr->count >= hdr->limit) {
+		brelse(bh);
+		err = HUST_dx_grow(dir, frames, nframes);
+		HUST_dx_release(frames, nframes);
+		if (err)
+			return err;
+		goto again;
+	}
+	nbh = HUST_dir_new_block(dir, &nblk);
+	if (IS_ERR(nbh)) {
+		err = PTR_ERR(nbh);
+		goto release;
+	}
+	err = HUST_leaf_split(dir, bh->b_data, nbh->b_data, &split);
+	if (!err)
+		err = HUST_dx_insert(dir, frames[nframes - 1].bh,
+				     frames[nframes - 1].at, split, nblk);
+	if (!err)
+		/* each half is at most about half full now */
+		err = HUST_leaf_add(dir, hash >= split ? nbh->b_data : bh->b_data,
+				    name->name, name->len, inode_no, file_type);
+	HUST_journal_dirty_inode_buffer(dir, nbh);
+	brelse(nbh);
+ dirty:
+	HUST_journal_dirty_inode_buffer(dir, bh);
+ release:
+	brelse(bh);
+ out:
+	HUST_dx_release(frames, nframes);
+	return err;
+}
+
+/* Turn the full single-block directory @dir into an index with two leaves. */
+static int HUST_dx_make_index(struct inode *dir)
+{
+	struct HUST_dx_entry *entries;
+	struct buffer_head *root, *l1, *l2;
+	uint64_t b1, b2;
+	uint32_t split;
+	int err;
+
+	root = HUST_dir_bread(dir, 0);
+	if (!root)
+		return -EIO;
+	err = HUST_journal_get_write_access(dir->i_sb, root);
+	if (err)
+		goto out_root;
+	l1 = HUST_dir_new_block(dir, &b1);
+	if (IS_ERR(l1)) {
+		err = PTR_ERR(l1);
+		goto out_root;
+	}
+	l2 = HUST_dir_new_block(dir, &b2);
+	if (IS_ERR(l2)) {
+		err = PTR_ERR(l2);
+		goto out_l1;
+	}
+
+	memcpy(l1->b_data, root->b_data, HUST_BLOCK_SIZE(dir->i_sb));
+	err = HUST_leaf_split(dir, l1->b_data, l2->b_data, &split);
+	if (err) {
+		/* leave the copies as empty blocks of the linear directory */
+		HUST_leaf_init(dir, l1->b_data);
+		goto out_l2;
+	}
+
+	memset(root->b_data, 0, HUST_BLOCK_SIZE(dir->i_sb));
+	HUST_dx_init_node(dir, root, 0);
+	entries = HUST_dx_entries(root);
+	entries[0].hash = 0;
+	entries[0].block = b1;
+	entries[1].hash = split;
+	entries[1].block = b2;
+	((struct HUST_dx_header *)root->b_data)->count = 2;
+	err = HUST_journal_dirty_inode_buffer(dir, root);
+
+	HUST_I(dir)->i_flags |= HUST_INDEX_FL;
+	mark_inode_dirty(dir);
+ out_l2:
+	HUST_journal_dirty_inode_buffer(dir, l2);
+	brelse(l2);
+ out_l1:
+	HUST_journal_dirty_inode_buffer(dir, l1);
+	brelse(l1);
+ out_root:
+	brelse(root);
+	return err;
+}
+
+int HUST_dir_add_entry(struct inode *dir, const struct qstr *name,
+		       uint64_t inode_no, umode_t mode)
+{
+	struct HUST_inode_info *hi = HUST_I(dir);
+	struct buffer_head *bh;
+	unsigned int file_type = HUST_type_by_mode[(mode & S_IFMT) >> 12];
+	uint64_t lblk;
+	int err;
+
+	if (hi->i_flags & HUST_INDEX_FL)
+		return HUST_dx_add_entry(dir, name, inode_no, file_type);
+
+	for (lblk = 0; lblk < hi->blocks; lblk++) {
+		bh = HUST_dir_bread(dir, lblk);
+		if (!bh)
+			return -EIO;
+		err = HUST_journal_get_write_access(dir->i_sb, bh);
+		if (!err)
+			err = HUST_leaf_add(dir, bh->b_data, name->name,
+					    name->len, inode_no, file_type);
+		if (err != -ENOSPC) {
+			if (!err)
+				err = HUST_journal_dirty_inode_buffer(dir, bh);
+			brelse(bh);
+			return err;
+		}
+		brelse(bh);
+	}
+
+	if (hi->blocks == 1 &&
+	    (HUST_SB(dir->i_sb)->s_disk->features & HUST_FEATURE_DIR_INDEX)) {
+		err = HUST_dx_make_index(dir);
+		if (!err)
+			return HUST_dx_add_entry(dir, name, inode_no, file_type);
+		if (err != -ENOSPC)
+			return err;
+	}
+
+	bh = HUST_dir_new_block(dir, &lblk);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	err = HUST_leaf_add(dir, bh->b_data, name->name, name->len,
+			    inode_no, file_type);
+	if (!err)
+		err = HUST_journal_dirty_inode_buffer(dir, bh);
+	brelse(bh);
+	return err;
+}
+
+/* Give the new directory @inode its first block with "." and "..". */
+int HUST_dir_make_empty(struct inode *inode, struct inode *parent)
+{
+	struct buffer_head *bh;
+	uint64_t lblk;
+	int err;
+
+	bh = HUST_dir_new_block(inode, &lblk);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	HUST_leaf_add(inode, bh->b_data, ".", 1, inode->i_ino, HUST_FT_DIR);
+	HUST_leaf_add(inode, bh->b_data, "..", 2, parent->i_ino, HUST_FT_DIR);
+	err = HUST_journal_dirty_inode_buffer(inode, bh);
+	brelse(bh);
+	if (err)
+		return err;
+	HUST_I(inode)->dir_children_count = 2;
+	return 0;
+}
@@ -0,0 +1,321 @@
+#include "constants.h"
+#include "HUST_fs.h"
+#include <linux/log2.h>
+
+/*
+ * In-memory name cache of a directory.
+ *
+ * The first lookup in a directory of at least dircache= blocks, two by
+ * default, reads it once and records the hash of every name.  A name
+ * whose hash is not there is known to be absent without touching the
+ * disk, which is what makes misses cheap: negative dentries for
+ * PATH-like searches and the lookup before every create.  Hits still go through the index to the leaf.
+ * Only hashes are kept, as record positions change whenever a leaf of a
+ * hashed directory is split.
+ *
+ * create and unlink keep the cache current under the exclusive i_rwsem,
+ * so a lookup, which holds it shared, reads the chains without a lock;
+ * RCU keeps a cache the shrinker drops alive until such readers are
+ * done.  Each cache has its own lock for its count against the shrinker.
+ * The caches of all mounts sit on one LRU that a shrinker trims under
+ * memory pressure; a dropped cache is rebuilt by the next lookup.
+ */
+
+struct HUST_dircache {
+	struct list_head lru;
+	struct HUST_inode_info *owner;
+	spinlock_t lock;	/* count and dead against the shrinker */
+	unsigned long count;
+	bool dead;		/* detached, freed after a grace period */
+	unsigned int nbuckets;	/* power of two */
+	bool referenced;	/* hit since the shrinker last passed */
+	struct rcu_head rcu;
+	struct hlist_head buckets[];
+};
+
+struct HUST_dircache_node {
+	struct hlist_node link;
+	uint32_t hash;
+};
+
+/* protects the LRU and the setting and clearing of hi->i_dircache */
+static DEFINE_SPINLOCK(HUST_dircache_lock);
+static LIST_HEAD(HUST_dircache_lru);
+static atomic_long_t HUST_dircache_nodes;
+
+static struct hlist_head *HUST_dircache_bucket(struct HUST_dircache *c,
+					       uint32_t hash)
+{
+	return &c->buckets[hash & (c->nbuckets - 1)];
+}
+
+static void HUST_dircache_free(struct HUST_dircache *c)
+{
+	struct HUST_dircache_node *node;
+	struct hlist_node *tmp;
+	unsigned int i;
+
+	for (i = 0; i < c->nbuckets; i++)
+		hlist_for_each_entry_safe(node, tmp, &c->buckets[i], link)
+			kfree(node);
+	kvfree(c);
+}
+
+static void HUST_dircache_free_rcu(struct rcu_head *head)
+{
+	HUST_dircache_free(container_of(head, struct HUST_dircache, rcu));
+}
+
+/* Caller holds HUST_dircache_lock; frees the cache once lookups are done. */
+static void HUST_dircache_detach(struct HUST_inode_info *hi)
+{
+	struct HUST_dircache *c;
+
+	c = rcu_dereference_protected(hi->i_dircache,
+				      lockdep_is_held(&HUST_dircache_lock));
+	if (!c)
+		return;
+	RCU_INIT_POINTER(hi->i_dircache, NULL);
+	list_del(&c->lru);
+	spin_lock(&c->lock);
+	c->dead = true;
+	atomic_long_sub(c->count, &HUST_dircache_nodes);
+	spin_unlock(&c->lock);
+	call_rcu(&c->rcu, HUST_dircache_free_rcu);
+}
+
+static int HUST_dircache_insert(struct HUST_dircache *c, uint32_t hash)
+{
+	struct HUST_dircache_node *node;
+
+	node = kmalloc(sizeof(*node), GFP_NOFS);
+	if (!node)
+		return -ENOMEM;
+	node->hash = hash;
+	hlist_add_head(&node->link, HUST_dircache_bucket(c, hash));
+	c->count++;
+	return 0;
+}
+
+static struct HUST_dircache *HUST_dircache_build(struct inode *dir)
+{
+	struct HUST_inode_info *hi = HUST_I(dir);
+	struct HUST_dircache *c;
+	unsigned int nbuckets;
+	uint64_t lblk;
+	int ret = 0;
+
+	nbuckets = roundup_pow_of_two(max_t(uint64_t, hi->dir_children_count, 16));
+	c = kvzalloc(sizeof(*c) + nbuckets * sizeof(struct hlist_head),
+		     GFP_NOFS);
+	if (!c)
+		return ERR_PTR(-ENOMEM);
+	c->owner = hi;
+	c->nbuckets = nbuckets;
+	spin_lock_init(&c->lock);
+
+	for (lblk = 0; lblk < hi->blocks && !ret; lblk++) {
+		struct buffer_head *bh = HUST_dir_bread(dir, lblk);
+		struct HUST_dirent de;
+		unsigned int offset = 0;
+
+		if (!bh) {
+			ret = -EIO;
+			break;
+		}
+		if (!HUST_dir_is_index(bh->b_data)) {
+			while ((ret = HUST_dir_leaf_next(dir, bh->b_data, offset,
+							 &de)) > 0) {
+				ret = HUST_dircache_insert(c,
+					HUST_dir_hash(de.name, de.name_len));
+				if (ret)
+					break;
+				offset = de.next;
+			}
+		}
+		brelse(bh);
+	}
+	if (ret) {
+		HUST_dircache_free(c);
+		return ERR_PTR(ret);
+	}
+	return c;
+}
+
+static bool HUST_dircache_probe(struct HUST_dircache *c, uint32_t hash)
+{
+	struct HUST_dircache_node *node;
+
+	if (!READ_ONCE(c->referenced))
+		WRITE_ONCE(c->referenced, true);
+	hlist_for_each_entry(node, HUST_dircache_bucket(c, hash), link)
+		if (node->hash == hash)
+			return true;
+	return false;
+}
+
+/*
+ * Returns -ENOENT when @name is certainly not in @dir, 0 when it may be
+ * and the directory has to be searched.  Called under the shared
+ * i_rwsem, so two lookups can race to build the cache.
+ */
+int HUST_dircache_lookup(struct inode *dir, const struct qstr *name)
+{
+	struct HUST_inode_info *hi = HUST_I(dir);
+	uint32_t hash = HUST_dir_hash(name->name, name->len);
+	struct HUST_dircache *c;
+	bool found = false;
+	unsigned int min;
+
+	rcu_read_lock();
+	c = rcu_dereference(hi->i_dircache);
+	if (c)
+		found = HUST_dircache_probe(c, hash);
+	rcu_read_unlock();
+	if (c)
+		return found ? 0 : -ENOENT;
+
+	/* small directories are found in the buffer cache as fast */
+	min = HUST_SB(dir->i_sb)->s_opts.dircache_blocks;
+	if (!min || hi->blocks < min)
+		return 0;
+	c = HUST_dircache_build(dir);
+	if (IS_ERR(c))
+		return 0;
+	/* built from the blocks, so it answers this lookup either way */
+	found = HUST_dircache_probe(c, hash);
+
+	spin_lock(&HUST_dircache_lock);
+	if (rcu_access_pointer(hi->i_dircache)) {
+		spin_unlock(&HUST_dircache_lock);
+		HUST_dircache_free(c);
+	} else {
+		list_add(&c->lru, &HUST_dircache_lru);
+		atomic_long_add(c->count, &HUST_dircache_nodes);
+		rcu_assign_pointer(hi->i_dircache, c);
+		spin_unlock(&HUST_dircache_lock);
+	}
+	return found ? 0 : -ENOENT;
+}
+
+/* @name was added to @dir; called under the exclusive i_rwsem. */
+void HUST_dircache_add(struct inode *dir, const struct qstr *name)
+{
+	struct HUST_inode_info *hi = HUST_I(dir);
+	struct HUST_dircache_node *node;
+	struct HUST_dircache *c;
+	bool rebuild = false;
+
+	if (!rcu_access_pointer(hi->i_dircache))
+		return;
+	node = kmalloc(sizeof(*node), GFP_NOFS);
+
+	rcu_read_lock();
+	c = rcu_dereference(hi->i_dircache);
+	if (c) {
+		spin_lock(&c->lock);
+		if (c->dead) {
+			/* the shrinker got there first */
+		} else if (!node || c->count >= 4 * c->nbuckets) {
+			/* a missing name would read as absent; rebuild it bigger */
+			rebuild = true;
+		} else {
+			node->hash = HUST_dir_hash(name->name, name->len);
+			hlist_add_head(&node->link,
+				       HUST_dircache_bucket(c, node->hash));
+			c->count++;
+			atomic_long_inc(&HUST_dircache_nodes);
+			node = NULL;
+		}
+		spin_unlock(&c->lock);
+	}
+	rcu_read_unlock();
+	kfree(node);
+	if (rebuild)
+		HUST_dircache_drop(dir);
+}
+
+/* @name was removed from @dir; called under the exclusive i_rwsem. */
+void HUST_dircache_del(struct inode *dir, const struct qstr *name)
+{
+	struct HUST_inode_info *hi = HUST_I(dir);
+	uint32_t hash = HUST_dir_hash(name->name, name->len);
+	struct HUST_dircache_node *node, *victim = NULL;
+	struct HUST_dircache *c;
+
+	rcu_read_lock();
+	c = rcu_dereference(hi->i_dircache);
+	if (c) {
+		spin_lock(&c->lock);
+		hlist_for_each_entry(node, HUST_dircache_bucket(c, hash), link) {
+			if (node->hash == hash) {
+				/* any one of equal hashes will do */
+				hlist_del(&node->link);
+				if (!c->dead) {
+					c->count--;
+					atomic_long_dec(&HUST_dircache_nodes);
+				}
+				victim = node;
+				break;
+			}
+		}
+		spin_unlock(&c->lock);
+	}
+	rcu_read_unlock();
+	kfree(victim);
+}
+
+void HUST_dircache_drop(struct inode *dir)
+{
+	spin_lock(&HUST_dircache_lock);
+	HUST_dircache_detach(HUST_I(dir));
+	spin_unlock(&HUST_dircache_lock);
+}
+
+static unsigned long HUST_dircache_count(struct shrinker *shrink,
+					 struct shrink_control *sc)
+{
+	return max(atomic_long_read(&HUST_dircache_nodes), 0L);
+}
+
+/* Drop whole caches from the cold end, giving referenced ones another round. */
+static unsigned long HUST_dircache_scan(struct shrinker *shrink,
+					struct shrink_control *sc)
+{
+	struct HUST_dircache *c;
+	unsigned long scanned = 0, freed = 0;
+
+	spin_lock(&HUST_dircache_lock);
+	while (scanned < sc->nr_to_scan && !list_empty(&HUST_dircache_lru)) {
+		c = list_last_entry(&HUST_dircache_lru, struct HUST_dircache, lru);
+		if (READ_ONCE(c->referenced)) {
+			WRITE_ONCE(c->referenced, false);
+			list_move(&c->lru, &HUST_dircache_lru);
+			scanned++;
+			continue;
+		}
+		scanned += c->count;
+		freed += c->count;
+		HUST_dircache_detach(c->owner);
+	}
+	spin_unlock(&HUST_dircache_lock);
+	return freed;
+}
+
+static struct shrinker HUST_dircache_shrinker = {
+	.count_objects = HUST_dircache_count,
+	.scan_objects = HUST_dircache_scan,
+	.seeks = DEFAULT_SEEKS,
+};
+
+int HUST_dircache_init(void)
+{
+	return register_shrinker(&HUST_dircache_shrinker);
+}
+
+void HUST_dircache_exit(void)
+{
+	unregister_shrinker(&HUST_dircache_shrinker);
+	/* caches dropped at evict may still be waiting to be freed */
+	rcu_barrier();
+}
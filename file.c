@@ -1,14 +1,22 @@
 #include "HUST_fs.h"
 #include "constants.h"
+#include <linux/blkdev.h>
+#include <linux/mount.h>
+#include <linux/compat.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/writeback.h>
+#include <linux/sched/signal.h>
+#include "HUST_trace.h"
 
 int HUST_fs_readpage(struct file *file, struct page *page)
 {
-	printk(KERN_ERR "HUST: readpage");
+	trace_readpage(page);
 	return block_read_full_page(page, HUST_fs_get_block);
 }
 
 int HUST_fs_writepage(struct page* page, struct writeback_control* wbc) {
-	printk(KERN_ERR "HUST: in write page\n");
+	trace_writepage(page);
        return block_write_full_page(page, HUST_fs_get_block, wbc);
 }
 
@@ -16,73 +24,214 @@ int HUST_fs_write_begin(struct file* file, struct address_space* mapping,
 		loff_t pos, unsigned len, unsigned flags, 
 		struct page** pagep, void** fsdata) {
     int ret;
-	printk(KERN_INFO "HUST: in write_begin\n");
     ret = block_write_begin(mapping, pos, len, flags, pagep, HUST_fs_get_block);
-    if (unlikely(ret))
-        printk(KERN_INFO "HUST: Write failed for pos [%llu], len [%u]\n", pos, len);
+    trace_write_begin(mapping->host, pos, len, ret);
     return ret;
 }
 
-
-int HUST_fs_iterate(struct file *filp, struct dir_context *ctx)
+/*
+ * Copy @len bytes at @pos_in of @inode_in to @pos_out of @file_out, one
+ * page-sized piece at a time straight from page to page.  Both sides go
+ * through their page caches, which are what reads and writes of the
+ * files see; block device buffers would alias the same blocks and go
+ * stale on the next write.  Returns the bytes copied or an error.
+ */
+static ssize_t HUST_fs_copy_pages(struct inode *inode_in, loff_t pos_in,
+				  struct file *file_out, loff_t pos_out,
+				  size_t len)
 {
-	struct HUST_inode H_inode;
-	struct super_block *sb = filp->f_inode->i_sb;
+	struct address_space *mapping = file_out->f_mapping;
+	ssize_t copied = 0;
+	int ret = 0;
 
-	printk(KERN_INFO "HUST_fs: Iterate on inode [%llu]\n",
-	       filp->f_inode->i_ino);
+	while (len) {
+		unsigned int off_in = pos_in & (PAGE_SIZE - 1);
+		unsigned int off_out = pos_out & (PAGE_SIZE - 1);
+		unsigned int n = min_t(size_t, len,
+				       PAGE_SIZE - max(off_in, off_out));
+		struct page *src, *dst;
+		void *fsdata;
+		char *from, *to;
 
-	if (-1 == HUST_fs_get_inode(sb, filp->f_inode->i_ino, &H_inode))
-		return -EFAULT;
-
-	printk(KERN_INFO "H_inode.dir_children_count is %llu\n",
-	       H_inode.dir_children_count);
-	if (ctx->pos >= H_inode.dir_children_count) {
-		return 0;
+		src = read_mapping_page(inode_in->i_mapping,
+					pos_in >> PAGE_SHIFT, NULL);
+		if (IS_ERR(src)) {
+			ret = PTR_ERR(src);
+			break;
+		}
+		ret = pagecache_write_begin(file_out, mapping, pos_out, n, 0,
+					    &dst, &fsdata);
+		if (ret) {
+			put_page(src);
+			break;
+		}
+		from = kmap_atomic(src);
+		to = kmap_atomic(dst);
+		memcpy(to + off_out, from + off_in, n);
+		kunmap_atomic(to);
+		kunmap_atomic(from);
+		flush_dcache_page(dst);
+		put_page(src);
+		ret = pagecache_write_end(file_out, mapping, pos_out, n, n,
+					  dst, fsdata);
+		if (ret < 0)
+			break;
+		ret = 0;
+		pos_in += n;
+		pos_out += n;
+		copied += n;
+		len -= n;
+		balance_dirty_pages_ratelimited(mapping);
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
 	}
+	return copied ? copied : ret;
+}
+
+ssize_t HUST_fs_copy_file_range(struct file *file_in, loff_t pos_in,
+				struct file *file_out, loff_t pos_out,
+				size_t len, unsigned int flags)
+{
+	/*
+	 * Copy between the two page caches instead of bouncing the data
+	 * through a pipe.  Anything that is not block aligned is left to
+	 * the VFS, which falls back to do_splice_direct().
+	 */
+	struct inode *inode_in = file_inode(file_in);
+	struct inode *inode_out = file_inode(file_out);
+	unsigned int bsize = HUST_BLOCK_SIZE(inode_out->i_sb);
+	loff_t size_in;
+	ssize_t ret;
+
+	if (inode_in == inode_out)
+		return -EOPNOTSUPP;
+	if ((pos_in | pos_out) & (bsize - 1))
+		return -EOPNOTSUPP;
 
-	if (H_inode.blocks == 0) {
-		printk(KERN_INFO
-		       "HUST_fs: inode [%lu] has no data!\n",
-		       filp->f_inode->i_ino);
+	size_in = i_size_read(inode_in);
+	if (pos_in >= size_in)
 		return 0;
+	if (len > size_in - pos_in)
+		len = size_in - pos_in;
+
+	inode_lock(inode_out);
+	ret = file_remove_privs(file_out);
+	if (ret)
+		goto out_unlock;
+	ret = HUST_fs_copy_pages(inode_in, pos_in, file_out, pos_out, len);
+	if (ret > 0) {
+		inode_out->i_mtime = inode_out->i_ctime =
+			current_time(inode_out);
+		mark_inode_dirty(inode_out);
 	}
+ out_unlock:
+	inode_unlock(inode_out);
+	return ret;
+}
 
-	uint64_t i, dir_unread;
-	dir_unread = H_inode.dir_children_count;
-	printk(KERN_INFO "HUST_fs: dir_unread [%llu]\n", dir_unread);
-	if (dir_unread == 0) {
-		return 0;
+/*
+ * Stream the records straight out of the buffer cache.  In a linear
+ * directory ctx->pos is a cookie of block number * block size + offset
+ * in that block, so a listing resumes in the block it stopped in; its
+ * records never move to another block.  An indexed directory splits
+ * leaves, so there it is a name hash, see HUST_dx_readdir().  Only
+ * buffers are read, so this runs under the shared i_rwsem alongside
+ * lookups.
+ */
+int HUST_fs_iterate(struct file *filp, struct dir_context *ctx)
+{
+	struct inode *dir = file_inode(filp);
+	struct HUST_inode_info *hi = HUST_I(dir);
+	unsigned int bsize = HUST_BLOCK_SIZE(dir->i_sb);
+	uint64_t lblk = ctx->pos / bsize;
+	unsigned int offset = ctx->pos % bsize;
+	bool revalidate = filp->f_version != dir->i_version;
+	uint64_t ra_last = 0;	/* block 0 is never in the inode table */
+	struct blk_plug plug;
+	int err = 0;
+
+	/* batch the inode table readahead issued for the names below */
+	blk_start_plug(&plug);
+	if (hi->i_flags & HUST_INDEX_FL) {
+		err = HUST_dx_readdir(filp, ctx);
+		goto out;
 	}
+	for (; lblk < hi->blocks; lblk++, offset = 0) {
+		struct buffer_head *bh;
+		struct HUST_dirent de;
+		int ret;
 
-	struct HUST_dir_record *dir_arr =
-	    kmalloc(sizeof(struct HUST_dir_record) * dir_unread, GFP_KERNEL);
-
-	struct buffer_head *bh;
-	for (i = 0; (i < H_inode.blocks) && (dir_unread > 0); ++i) {
-		bh = sb_bread(sb, H_inode.block[i]);
-		uint64_t len = dir_unread * sizeof(struct HUST_dir_record);
-		uint64_t off = H_inode.dir_children_count - dir_unread;
-		if (len < HUST_BLOCKSIZE) {	//read over
-			memcpy(dir_arr + (off * sizeof(struct HUST_dir_record)),
-			       bh->b_data, len);
-			dir_unread = 0;
-		} else {
-			memcpy(dir_arr + (off * sizeof(struct HUST_dir_record)),
-			       bh->b_data, HUST_BLOCKSIZE);
-			dir_unread -=
-			    HUST_BLOCKSIZE / sizeof(struct HUST_dir_record);
+		bh = HUST_dir_bread(dir, lblk);
+		if (!bh) {
+			err = -EIO;
+			break;
+		}
+		/* index blocks of a hashed directory hold no records */
+		if (HUST_dir_is_index(bh->b_data)) {
+			brelse(bh);
+			continue;
+		}
+		if (revalidate) {
+			/* the directory changed since ctx->pos was handed out */
+			offset = HUST_dir_leaf_validate(dir, bh->b_data, offset);
+			filp->f_version = dir->i_version;
+			revalidate = false;
+		}
+		while ((ret = HUST_dir_leaf_next(dir, bh->b_data, offset,
+						 &de)) > 0) {
+			ctx->pos = lblk * bsize + de.offset;
+			if (!dir_emit(ctx, de.name, de.name_len, de.inode_no,
+				      HUST_dir_dtype(&de))) {
+				brelse(bh);
+				goto out;
+			}
+			HUST_fs_inode_readahead(dir->i_sb, de.inode_no, &ra_last);
+			offset = de.next;
 		}
 		brelse(bh);
+		if (ret < 0) {
+			err = ret;
+			break;
+		}
+		ctx->pos = (lblk + 1) * bsize;
 	}
-	for (i = 0; i < H_inode.dir_children_count; ++i) {
-		printk(KERN_INFO " dir_arr[i].filename is %s\n",
-		       dir_arr[i].filename);
-		dir_emit(ctx, dir_arr[i].filename, strlen(dir_arr[i].filename),
-			 dir_arr[i].inode_no, DT_REG);
-		ctx->pos++;
+ out:
+	blk_finish_plug(&plug);
+	trace_iterate(dir, ctx->pos, err);
+	return err;
+}
+
+long HUST_fs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct super_block *sb = file_inode(filp)->i_sb;
+	uint64_t blocks;
+	long ret;
+
+	switch (cmd) {
+	case HUST_IOC_RESIZE:
+		if (!capable(CAP_SYS_RESOURCE))
+			return -EPERM;
+		if (get_user(blocks, (uint64_t __user *)arg))
+			return -EFAULT;
+		ret = mnt_want_write_file(filp);
+		if (ret)
+			return ret;
+		ret = HUST_fs_resize(sb, &blocks);
+		mnt_drop_write_file(filp);
+		if (!ret && put_user(blocks, (uint64_t __user *)arg))
+			ret = -EFAULT;
+		return ret;
+	default:
+		return -ENOTTY;
 	}
-	kfree(dir_arr);
-	printk(KERN_INFO "ctx->pos is %llu\n", ctx->pos);
-	return 0;
 }
+
+#ifdef CONFIG_COMPAT
+long HUST_fs_compat_ioctl(struct file *filp, unsigned int cmd,
+			  unsigned long arg)
+{
+	return HUST_fs_ioctl(filp, cmd, (unsigned long)compat_ptr(arg));
+}
+#endif
@@ -0,0 +1,232 @@
+#include "constants.h"
+#include "HUST_fs.h"
+#include <linux/blkdev.h>
+#include <linux/workqueue.h>
+
+/*
+ * A group is inodes_per_group consecutive inodes with their own slice of
+ * the inode table.  mkfs only zeroes the slice of group 0 and flags the
+ * others HUST_BG_ITABLE_UNINIT; such a slice reads as all zero until it
+ * is zeroed, either on the first allocation in the group or by the lazy
+ * init work queued at mount.
+ *
+ * When every inode is in use the table grows by one group at a time: a
+ * run of free data blocks becomes the new group's slice and is recorded
+ * in its descriptor, up to the max_inodes the imap was sized for.
+ *
+ * File systems without HUST_FEATURE_GROUPS are handled as one group that
+ * covers the whole, already initialized inode table.
+ */
+
+int HUST_fs_load_groups(struct super_block *sb)
+{
+	struct HUST_sb_info *sbi = HUST_SB(sb);
+	struct HUST_fs_super_block *disk_sb = sbi->s_disk;
+	unsigned int per_block = HUST_BLOCK_SIZE(sb) / sbi->s_inode_size;
+	uint64_t i, gdt_blocks;
+
+	if (!(disk_sb->features & HUST_FEATURE_GROUPS)) {
+		sbi->s_inodes_per_group = disk_sb->inodes_count;
+		sbi->s_groups_count = 1;
+		sbi->s_max_groups = 1;
+		sbi->s_gd = kvzalloc(sizeof(struct HUST_group_desc), GFP_KERNEL);
+		if (!sbi->s_gd)
+			return -ENOMEM;
+		sbi->s_gd[0].itable_block = disk_sb->inode_table_block;
+		/* the journal, if any, sits between the table and the data */
+		sbi->s_gd[0].itable_blocks =
+		    (disk_sb->features & HUST_FEATURE_JOURNAL ?
+		     disk_sb->journal_block : disk_sb->data_block_number) -
+		    disk_sb->inode_table_block;
+		return 0;
+	}
+
+	if (!disk_sb->inodes_per_group ||
+	    disk_sb->inodes_per_group % per_block ||
+	    disk_sb->groups_count !=
+	    DIV_ROUND_UP(disk_sb->inodes_count, disk_sb->inodes_per_group)) {
+		printk(KERN_ERR "HUST_fs: bad group geometry\n");
+		return -EINVAL;
+	}
+	sbi->s_inodes_per_group = disk_sb->inodes_per_group;
+	sbi->s_groups_count = disk_sb->groups_count;
+	sbi->s_max_groups = max_t(uint64_t, sbi->s_groups_count,
+		DIV_ROUND_UP(disk_sb->max_inodes, sbi->s_inodes_per_group));
+	sbi->s_gd = kvzalloc(sbi->s_max_groups * sizeof(struct HUST_group_desc),
+			     GFP_KERNEL);
+	if (!sbi->s_gd)
+		return -ENOMEM;
+
+	gdt_blocks = DIV_ROUND_UP(sbi->s_groups_count, HUST_DESC_PER_BLOCK(sb));
+	for (i = 0; i < gdt_blocks; i++) {
+		struct buffer_head *bh;
+		uint64_t first = i * HUST_DESC_PER_BLOCK(sb);
+		uint64_t count = min_t(uint64_t, HUST_DESC_PER_BLOCK(sb),
+				       sbi->s_groups_count - first);
+
+		bh = HUST_sb_bread(sb, disk_sb->gdt_block + i);
+		if (!bh) {
+			printk(KERN_ERR "HUST_fs: cannot read group descriptors\n");
+			return -EIO;
+		}
+		memcpy(sbi->s_gd + first, bh->b_data,
+		       count * sizeof(struct HUST_group_desc));
+		brelse(bh);
+	}
+	return 0;
+}
+
+int HUST_fs_save_group_desc(struct super_block *sb, uint64_t group)
+{
+	struct HUST_sb_info *sbi = HUST_SB(sb);
+	struct buffer_head *bh;
+	uint64_t offset = group % HUST_DESC_PER_BLOCK(sb);
+	int err;
+
+	if (!(sbi->s_disk->features & HUST_FEATURE_GROUPS))
+		return 0;
+
+	bh = HUST_sb_bread(sb, sbi->s_disk->gdt_block + group / HUST_DESC_PER_BLOCK(sb));
+	if (!bh)
+		return -EIO;
+	err = HUST_journal_get_write_access(sb, bh);
+	if (!err) {
+		lock_buffer(bh);
+		memcpy(bh->b_data + offset * sizeof(struct HUST_group_desc),
+		       &sbi->s_gd[group], sizeof(struct HUST_group_desc));
+		unlock_buffer(bh);
+		err = HUST_journal_dirty_metadata(sb, bh);
+	}
+	brelse(bh);
+	return err;
+}
+
+int HUST_fs_itable_uninit(struct super_block *sb, uint64_t group)
+{
+	return READ_ONCE(HUST_SB(sb)->s_gd[group].flags) &
+	    HUST_BG_ITABLE_UNINIT;
+}
+
+int HUST_fs_init_itable(struct super_block *sb, uint64_t group)
+{
+	struct HUST_sb_info *sbi = HUST_SB(sb);
+	struct HUST_group_desc *gd = &sbi->s_gd[group];
+	handle_t *handle;
+	int ret = 0;
+
+	if (!HUST_fs_itable_uninit(sb, group))
+		return 0;
+
+	/* nested in the create that needs the group, or on its own */
+	handle = HUST_journal_start(sb, HUST_GDT_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	mutex_lock(&sbi->s_itable_mutex);
+	if (gd->flags & HUST_BG_ITABLE_UNINIT) {
+		/* nothing of this slice is in the buffer cache yet */
+		ret = sb_issue_zeroout(sb, gd->itable_block,
+				       gd->itable_blocks, GFP_NOFS);
+		if (!ret) {
+			WRITE_ONCE(gd->flags, gd->flags & ~HUST_BG_ITABLE_UNINIT);
+			ret = HUST_fs_save_group_desc(sb, group);
+		}
+	}
+	mutex_unlock(&sbi->s_itable_mutex);
+	HUST_journal_stop(handle);
+	return ret;
+}
+
+void HUST_fs_itable_work(struct work_struct *work)
+{
+	struct HUST_sb_info *sbi = container_of(to_delayed_work(work),
+						struct HUST_sb_info,
+						s_itable_work);
+	struct super_block *sb = sbi->s_sb;
+	uint64_t group;
+
+	if (sb_rdonly(sb))
+		return;
+
+	for (group = sbi->s_itable_next; group < sbi->s_groups_count; group++)
+		if (HUST_fs_itable_uninit(sb, group))
+			break;
+	if (group >= sbi->s_groups_count) {
+		if (HUST_test_opt(sb, DEBUG))
+			printk(KERN_INFO "HUST_fs: inode table initialized\n");
+		return;
+	}
+
+	if (HUST_fs_init_itable(sb, group)) {
+		printk(KERN_ERR "HUST_fs: cannot zero inode table of group %llu\n",
+		       group);
+		return;
+	}
+	sbi->s_itable_next = group + 1;
+	/* one group at a time, so foreground I/O is not starved */
+	queue_delayed_work(system_long_wq, &sbi->s_itable_work,
+			   msecs_to_jiffies(HUST_ITABLE_INIT_DELAY_MS));
+}
+
+void HUST_fs_start_itable_init(struct super_block *sb)
+{
+	struct HUST_sb_info *sbi = HUST_SB(sb);
+
+	/* read-only mounts and remounts are caught by the work itself */
+	if (!(sbi->s_disk->features & HUST_FEATURE_GROUPS))
+		return;
+	sbi->s_itable_next = 0;
+	queue_delayed_work(system_long_wq, &sbi->s_itable_work,
+			   msecs_to_jiffies(HUST_ITABLE_INIT_DELAY_MS));
+}
+
+/* @seen_inodes_count is the inodes_count the caller found exhausted */
+int HUST_fs_grow_itable(struct super_block *sb, uint64_t seen_inodes_count)
+{
+	struct HUST_sb_info *sbi = HUST_SB(sb);
+	struct HUST_fs_super_block *disk_sb = sbi->s_disk;
+	uint64_t group, start, count;
+	int ret = 0;
+
+	if (!(disk_sb->features & HUST_FEATURE_GROUPS))
+		return -ENOSPC;
+
+	mutex_lock(&sbi->s_grow_mutex);
+	group = sbi->s_groups_count;
+	/* someone else grew it while we were scanning the imap */
+	if (disk_sb->inodes_count != seen_inodes_count)
+		goto out;
+	/* only whole groups can be appended after the last one */
+	if (group >= sbi->s_max_groups ||
+	    disk_sb->inodes_count != group * sbi->s_inodes_per_group) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	count = sbi->s_inodes_per_group / (HUST_BLOCK_SIZE(sb) / sbi->s_inode_size);
+	ret = HUST_fs_alloc_contig_blocks(sb, count, &start);
+	if (ret)
+		goto out;
+
+	/* zeroed by HUST_fs_init_itable() on the first allocation in it */
+	sbi->s_gd[group].itable_block = start;
+	sbi->s_gd[group].itable_blocks = count;
+	sbi->s_gd[group].flags = HUST_BG_ITABLE_UNINIT;
+	ret = HUST_fs_save_group_desc(sb, group);
+	if (ret)
+		goto out;
+
+	ret = HUST_journal_get_write_access(sb, sbi->s_sbh);
+	if (ret)
+		goto out;
+	sbi->s_groups_count = group + 1;
+	disk_sb->groups_count = group + 1;
+	disk_sb->inodes_count += sbi->s_inodes_per_group;
+	percpu_counter_add(&sbi->s_freeinodes_counter, sbi->s_inodes_per_group);
+	save_super(sb);
+	if (HUST_test_opt(sb, DEBUG))
+		printk(KERN_INFO "HUST_fs: inode table grown to %llu groups\n",
+		       sbi->s_groups_count);
+ out:
+	mutex_unlock(&sbi->s_grow_mutex);
+	return ret;
+}
@@ -0,0 +1,41 @@
+/*
+ * Grow a mounted HUST_fs:
+ *   hustresize <mountpoint> <blocks>
+ * The block device (or loop file) must already be at least that large,
+ * and the image must have been made with room for it, see mkfs -G.
+ * The count is rounded down to a multiple of 64; the one used is printed.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "constants.h"
+
+int main(int argc, char *argv[])
+{
+	uint64_t blocks;
+	int fd;
+
+	if (argc != 3) {
+		printf("Usage: hustresize <mountpoint> <blocks>\n");
+		return -1;
+	}
+	blocks = strtoull(argv[2], NULL, 10);
+
+	fd = open(argv[1], O_RDONLY);
+	if (fd == -1) {
+		perror("Error opening the mountpoint");
+		return -1;
+	}
+	if (ioctl(fd, HUST_IOC_RESIZE, &blocks) == -1) {
+		perror("Resize failed");
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	printf("Grown to %llu blocks\n", (unsigned long long)blocks);
+	return 0;
+}
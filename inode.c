@@ -1,6 +1,8 @@
 #include "constants.h"
 #include "HUST_fs.h"
 #include <linux/time.h>
+#include <linux/blkdev.h>
+#include "HUST_trace.h"
 
 extern struct file_operations HUST_fs_file_ops ;
 
@@ -10,42 +12,152 @@ extern struct inode_operations HUST_fs_inode_ops;
 
 extern struct address_space_operations HUST_fs_aops;
 
+static struct kmem_cache *HUST_inode_cachep;
+
+struct inode *HUST_fs_alloc_inode(struct super_block *sb)
+{
+	struct HUST_inode_info *hi;
+
+	hi = kmem_cache_alloc(HUST_inode_cachep, GFP_KERNEL);
+	if (!hi)
+		return NULL;
+	hi->blocks = 0;
+	hi->dir_children_count = 0;
+	hi->i_flags = 0;
+	RCU_INIT_POINTER(hi->i_dircache, NULL);
+	hi->i_sync_tid = 0;
+	hi->i_bmap_lo = U64_MAX;
+	hi->i_bmap_hi = 0;
+	memset(hi->block, 0, sizeof(hi->block));
+	return &hi->vfs_inode;
+}
+
+static void HUST_fs_i_callback(struct rcu_head *head)
+{
+	struct inode *inode = container_of(head, struct inode, i_rcu);
+
+	kmem_cache_free(HUST_inode_cachep, HUST_I(inode));
+}
+
+void HUST_fs_destroy_inode(struct inode *inode)
+{
+	call_rcu(&inode->i_rcu, HUST_fs_i_callback);
+}
+
+static void HUST_fs_init_once(void *foo)
+{
+	struct HUST_inode_info *hi = foo;
+
+	mutex_init(&hi->alloc_mutex);
+	inode_init_once(&hi->vfs_inode);
+}
+
+int HUST_init_inodecache(void)
+{
+	HUST_inode_cachep = kmem_cache_create("HUST_inode_cache",
+					      sizeof(struct HUST_inode_info), 0,
+					      SLAB_RECLAIM_ACCOUNT |
+					      SLAB_MEM_SPREAD | SLAB_ACCOUNT,
+					      HUST_fs_init_once);
+	if (!HUST_inode_cachep)
+		return -ENOMEM;
+	return 0;
+}
+
+void HUST_destroy_inodecache(void)
+{
+	/* wait for HUST_fs_i_callback() before the cache goes away */
+	rcu_barrier();
+	kmem_cache_destroy(HUST_inode_cachep);
+}
+
 int HUST_write_inode(struct inode *inode, struct writeback_control *wbc)
 {
-    struct buffer_head * bh;
-	struct HUST_inode * raw_inode = NULL;
-    HUST_fs_get_inode(inode->i_sb, inode->i_ino, raw_inode);
-	if (!raw_inode)
-		return -EFAULT;
-	raw_inode->mode = inode->i_mode;
-	raw_inode->i_uid = fs_high2lowuid(i_uid_read(inode));
-	raw_inode->i_gid = fs_high2lowgid(i_gid_read(inode));
-	raw_inode->i_nlink = inode->i_nlink;
-	raw_inode->file_size = inode->i_size;
-    
-    raw_inode->i_atime = (inode->i_atime.tv_sec);
-    raw_inode->i_mtime = (inode->i_mtime.tv_sec);
-    raw_inode->i_ctime = (inode->i_ctime.tv_sec);
-    
-	//raw_inode->i_time = inode->i_mtime.tv_sec;
-	mark_buffer_dirty(bh);
+	/*
+	 * Encode the in-memory inode into its table block and leave the
+	 * block dirty.  Inodes sharing a table block are written together
+	 * when the block device buffers are flushed; only data integrity
+	 * writeback waits for the block here, together with the directory
+	 * and indirect blocks of the inode.
+	 */
+	struct HUST_inode_info *hi = HUST_I(inode);
+	struct HUST_inode raw_inode;
+	struct buffer_head *bh;
+	int err = 0;
+
+	if (HUST_SB(inode->i_sb)->s_journal) {
+		/* already logged by HUST_fs_dirty_inode(); sync_fs commits */
+		if (wbc->sync_mode != WB_SYNC_ALL || wbc->for_sync ||
+		    journal_current_handle())
+			return 0;
+		return HUST_journal_commit(inode->i_sb, hi->i_sync_tid);
+	}
+
+	mutex_lock(&hi->alloc_mutex);
+	HUST_fs_fill_raw_inode(inode, &raw_inode);
+	mutex_unlock(&hi->alloc_mutex);
+
+	bh = HUST_fs_update_inode(inode->i_sb, &raw_inode);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	/* sync(2) writes the whole block device right after the inodes */
+	if (wbc->sync_mode == WB_SYNC_ALL && !wbc->for_sync)
+		err = HUST_meta_sync_inode(inode, bh);
 	brelse(bh);
-    return 0;
+	return err;
+}
+
+/*
+ * With a journal the inode is copied into its table block as soon as it
+ * is dirtied, inside the handle of the operation that changed it, so it
+ * commits together with that operation's bitmap and directory blocks.
+ * Timestamp-only updates under lazytime come back here once they expire.
+ */
+void HUST_fs_dirty_inode(struct inode *inode, int flags)
+{
+	struct super_block *sb = inode->i_sb;
+	struct HUST_inode_info *hi = HUST_I(inode);
+	struct HUST_inode raw_inode;
+	struct buffer_head *bh;
+	handle_t *handle;
+
+	if (!HUST_SB(sb)->s_journal || flags == I_DIRTY_TIME)
+		return;
+	handle = HUST_journal_start(sb, HUST_INODE_CREDITS);
+	if (IS_ERR(handle)) {
+		printk(KERN_ERR "HUST_fs: cannot log inode [%lu]\n", inode->i_ino);
+		return;
+	}
+	mutex_lock(&hi->alloc_mutex);
+	HUST_fs_fill_raw_inode(inode, &raw_inode);
+	mutex_unlock(&hi->alloc_mutex);
+	bh = HUST_fs_update_inode(sb, &raw_inode);
+	if (!IS_ERR(bh)) {
+		hi->i_sync_tid = handle->h_transaction->t_tid;
+		brelse(bh);
+	}
+	HUST_journal_stop(handle);
 }
 
 void HUST_evict_inode(struct inode *vfs_inode)
 {
     struct super_block *sb = vfs_inode->i_sb;
-    printk(KERN_INFO "HUST evict: Clearing inode [%lu]\n", vfs_inode->i_ino);
+    handle_t *handle;
+    trace_evict(vfs_inode);
     truncate_inode_pages_final(&vfs_inode->i_data);
+    HUST_dircache_drop(vfs_inode);
+    /* its dirty directory or indirect blocks go with the block device */
+    invalidate_inode_buffers(vfs_inode);
     clear_inode(vfs_inode);
     if (vfs_inode->i_nlink)
-    {
-        printk(KERN_INFO "HUST evict: Inode [%lu] still has links\n", vfs_inode->i_ino);
+        return;
+    handle = HUST_journal_start(sb, HUST_EVICT_CREDITS);
+    if (IS_ERR(handle)) {
+        printk(KERN_ERR "HUST evict: cannot free inode [%lu]\n", vfs_inode->i_ino);
         return;
     }
-    printk(KERN_INFO "HUST evict: Inode [%lu] has no links!\n", vfs_inode->i_ino);
-    set_and_save_imap(sb, vfs_inode->i_ino, 0);
+    HUST_fs_release_inode(sb, vfs_inode->i_ino);
+    HUST_journal_stop(handle);
     return;
 }
 
@@ -62,7 +174,8 @@ int HUST_fs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 ssize_t HUST_write_inode_data(struct inode* inode, const void *buf, size_t count)
 {
     struct super_block *sb;
-    struct HUST_inode H_inode;
+    struct HUST_inode_info *hi = HUST_I(inode);
+    uint64_t need;
     
     sb = inode->i_sb;
     
@@ -70,50 +183,54 @@ ssize_t HUST_write_inode_data(struct inode* inode, const void *buf, size_t count
         printk(KERN_ERR "HUST: buf is null\n");
         return -EFAULT;
     }
-    if(count > HUST_BLOCKSIZE*HUST_N_BLOCKS) {
+    if(count > HUST_BLOCK_SIZE(sb)*HUST_fs_max_blocks(sb)) {
         return -ENOSPC;
     }
     
-    if (-1 == HUST_fs_get_inode(sb, inode->i_ino, &H_inode)){
-        printk(KERN_ERR "HUST: cannot read inode\n");
-		return -EFAULT;
-    }
-    if(count > HUST_BLOCKSIZE*H_inode.blocks) {
+    need = DIV_ROUND_UP(count, HUST_BLOCK_SIZE(sb));
+    if(need > hi->blocks) {
         int ret;
-        ret = alloc_block_for_inode(sb, &H_inode, 
-                              (count - HUST_BLOCKSIZE*H_inode.blocks) /HUST_BLOCKSIZE);
+        mutex_lock(&hi->alloc_mutex);
+        ret = alloc_block_for_inode(inode, need - hi->blocks);
+        mutex_unlock(&hi->alloc_mutex);
         if(ret) {
-            return -EFAULT;
+            return ret;
         }
         mark_inode_dirty(inode);
     }
     size_t count_res = count;
-    int i;
+    uint64_t i, phys;
     i = 0;
-    while(count_res && i < HUST_N_BLOCKS) {
+    while(count_res && i < hi->blocks) {
         struct buffer_head* bh;
-        bh = sb_bread(sb, H_inode.block[i]);
+        if(HUST_fs_bmap(inode, i, &phys)) {
+            return -EIO;
+        }
+        bh = HUST_sb_bread(sb, phys);
         BUG_ON(!bh);
         size_t cpy_size;
-        if(count_res >= HUST_BLOCKSIZE) {
-            count_res -= HUST_BLOCKSIZE;
-            cpy_size = HUST_BLOCKSIZE;
+        if(count_res >= HUST_BLOCK_SIZE(sb)) {
+            count_res -= HUST_BLOCK_SIZE(sb);
+            cpy_size = HUST_BLOCK_SIZE(sb);
         }
         else {
-            count_res = 0;
             cpy_size = count_res;
+            count_res = 0;
         }
-        memcpy(bh->b_data, buf+i*HUST_BLOCKSIZE, cpy_size);
-        map_bh(bh, sb,H_inode.block[i]);
+        memcpy(bh->b_data, buf+i*HUST_BLOCK_SIZE(sb), cpy_size);
+        mark_buffer_dirty_inode(bh, inode);
         i++;
         brelse(bh);
     }
-    while(i < H_inode.blocks) {
+    while(i < hi->blocks) {
         struct buffer_head* bh;
-        bh = sb_bread(sb, H_inode.block[i]);
+        if(HUST_fs_bmap(inode, i, &phys)) {
+            return -EIO;
+        }
+        bh = HUST_sb_bread(sb, phys);
         BUG_ON(!bh);
-        memset(bh->b_data, 0, HUST_BLOCKSIZE);
-        map_bh(bh, sb, H_inode.block[i]);
+        memset(bh->b_data, 0, HUST_BLOCK_SIZE(sb));
+        mark_buffer_dirty_inode(bh, inode);
         brelse(bh);
         i++;
     }
@@ -128,166 +245,289 @@ ssize_t HUST_read_inode_data(struct inode* inode,void* buf, size_t size)
     }
     memset(buf, 0, size);
     struct super_block *sb = inode->i_sb;
-	printk(KERN_INFO "HUST: read inode [%llu]\n", inode->i_ino);
-	struct HUST_inode H_inode;
-	if (-1 == HUST_fs_get_inode(sb, inode->i_ino, &H_inode)){
-        printk(KERN_ERR "HUST: cannot read inode\n");
-		return -EFAULT;
-    }
-    int i;
-    for(i = 0; i < H_inode.blocks; ++i) {
+	struct HUST_inode_info *hi = HUST_I(inode);
+    uint64_t i, phys;
+    for(i = 0; i < hi->blocks; ++i) {
         struct buffer_head* bh;
-        bh = sb_bread(sb, H_inode.block[i]);
+        if(HUST_fs_bmap(inode, i, &phys)) {
+            return i*HUST_BLOCK_SIZE(sb);
+        }
+        bh = HUST_sb_bread(sb, phys);
         BUG_ON(!bh);
-        if((i+1)*HUST_BLOCKSIZE > size){
+        if((i+1)*HUST_BLOCK_SIZE(sb) > size){
             brelse(bh);
-            return i*HUST_BLOCKSIZE;
+            return i*HUST_BLOCK_SIZE(sb);
         }
-        memcpy(buf + i*(HUST_BLOCKSIZE), bh->b_data, HUST_BLOCKSIZE);
+        memcpy(buf + i*(HUST_BLOCK_SIZE(sb)), bh->b_data, HUST_BLOCK_SIZE(sb));
         brelse(bh);
     }
-	return i*(HUST_BLOCKSIZE);
+	return i*(HUST_BLOCK_SIZE(sb));
 }
 
 int HUST_fs_unlink(struct inode *dir, struct dentry *dentry)
 {
-    struct super_block* sb = dir->i_sb;
-    printk(KERN_INFO "HUST: unlink [%s] from dir inode [%lu]\n",
-           dentry->d_name.name, dir->i_ino);
-    struct HUST_inode H_dir_inode;
-    if(HUST_fs_get_inode(sb, dir->i_ino,&H_dir_inode)) {
-       return -EFAULT; 
+    struct inode *inode = d_inode(dentry);
+    struct HUST_inode_info *dir_hi = HUST_I(dir);
+    struct HUST_dirent de;
+    struct buffer_head *bh;
+    handle_t *handle;
+    int err;
+
+    handle = HUST_journal_start(dir->i_sb, HUST_UNLINK_CREDITS);
+    if(IS_ERR(handle)) {
+        trace_unlink(dir, dentry, PTR_ERR(handle));
+        return PTR_ERR(handle);
     }
-    ssize_t buf_size = H_dir_inode.blocks*HUST_BLOCKSIZE;
-    void* buf = kmalloc(buf_size, GFP_KERNEL);
-    if(HUST_read_inode_data(dir, buf, buf_size) != buf_size) {
-        printk(KERN_ERR "HUST_read_inode_data failed\n");
-        kfree(buf);
-        return -EFAULT;
+    /* through the index or one scan, then only the block that held it */
+    err = HUST_dir_find_entry(dir, &dentry->d_name, &de, &bh);
+    if(!err) {
+        err = HUST_dir_delete_entry(dir, &de, bh);
+        brelse(bh);
     }
-    struct inode *inode = d_inode(dentry);
-    int i;
-    struct HUST_dir_record* p_dir;
-    p_dir = (struct HUST_dir_record*) buf;
-    for(i = 0; i < H_dir_inode.dir_children_count; ++i) {
-        if(strncmp(dentry->d_name.name, p_dir[i].filename, HUST_FILENAME_MAX_LEN)) {
-            /* We have found our directory entry. We can now clear i
-             * and then decrease the inode's link count. 
-             */
-            H_dir_inode.dir_children_count -= 1;
-            //remove it from buf
-            struct HUST_dir_record* new_buf = kmalloc(buf_size - sizeof(struct HUST_dir_record), GFP_KERNEL);
-            memcpy(new_buf, p_dir, (i)*sizeof(struct HUST_dir_record));
-            memcpy(new_buf + i, p_dir + i + 1, 
-                       (H_dir_inode.dir_children_count -i- 1)*sizeof(struct HUST_dir_record));
-            HUST_write_inode_data(dir, new_buf, buf_size - sizeof(struct HUST_dir_record));
-            kfree(new_buf);
-            break;
-        }
+    if(err) {
+        HUST_journal_stop(handle);
+        trace_unlink(dir, dentry, err);
+        return err;
     }
+    HUST_dircache_del(dir, &dentry->d_name);
+    dir_hi->dir_children_count -= 1;
+
     inode_dec_link_count(inode);
     mark_inode_dirty(inode);
-    kfree(buf);
-    save_inode(sb, H_dir_inode);
-    return 0;
+    dir->i_mtime = dir->i_ctime = current_time(dir);
+    inode->i_ctime = dir->i_ctime;
+    /* makes open readdir streams recheck their position */
+    inode_inc_iversion(dir);
+    mark_inode_dirty(dir);
+    err = HUST_journal_stop(handle);
+    trace_unlink(dir, dentry, err);
+    return err;
 }
 
 int HUST_fs_create_obj(struct inode *dir, struct dentry *dentry, umode_t mode)
 {
     struct super_block* sb = dir->i_sb;
-    struct HUST_fs_super_block* disk_sb = sb->s_fs_info;
-	printk(KERN_ERR "In create obj and dir is %llu\n", (uint64_t)dir);
-    const unsigned char *name = dentry->d_name.name;
+    struct HUST_fs_super_block* disk_sb = HUST_SB(sb)->s_disk;
     
-    struct HUST_inode H_dir_inode;
-    HUST_fs_get_inode(sb, dir->i_ino, &H_dir_inode);
+    struct HUST_inode_info *dir_hi = HUST_I(dir);
+    u64 start = ktime_get_ns();
+    handle_t *handle;
         
-    if(H_dir_inode.dir_children_count >= HUST_BLOCKSIZE/sizeof(struct HUST_dir_record)) {
+    if(S_ISDIR(mode) &&
+       percpu_counter_read_positive(&HUST_SB(sb)->s_freeblocks_counter) <= 0) {
         return -ENOSPC;
     }
+    /* everything below commits as one transaction */
+    handle = HUST_journal_start(sb, HUST_CREATE_CREDITS);
+    if(IS_ERR(handle)) {
+        return PTR_ERR(handle);
+    }
+    int err;
     //1. write inode
-    uint64_t first_empty_inode_num = HUST_fs_get_empty_inode(dir->i_sb);
+    uint64_t inodes_count = disk_sb->inodes_count;
+    uint64_t first_empty_inode_num = 0;
+    err = HUST_fs_take_inode(sb, &first_empty_inode_num);
+    if(err == -ENOSPC) {
+        //inode table is full, add a group to it
+        err = HUST_fs_grow_itable(sb, inodes_count);
+        if(!err)
+            err = HUST_fs_take_inode(sb, &first_empty_inode_num);
+    }
+    if(err) {
+        goto out_stop;
+    }
     BUG_ON(!first_empty_inode_num);
+    err = HUST_fs_init_itable(sb, first_empty_inode_num / HUST_SB(sb)->s_inodes_per_group);
+    if(err) {
+        goto out_ifree;
+    }
     struct inode* inode;
-    struct HUST_inode raw_inode;
+    struct HUST_inode_info *hi;
     inode = new_inode(sb);
     if(!inode) {
-        return -ENOSPC;
+        err = -ENOSPC;
+        goto out_ifree;
     }
+    hi = HUST_I(inode);
     inode->i_ino = first_empty_inode_num;
-    raw_inode.inode_no = first_empty_inode_num;
     inode_init_owner(inode, dir, mode);
     inode->i_op = &HUST_fs_inode_ops;
-    raw_inode.i_uid = i_uid_read(inode);
-    raw_inode.i_gid = i_gid_read(inode);
-    raw_inode.i_nlink = inode->i_nlink;
-    struct timespec current_time;
-    getnstimeofday(&current_time);
-    inode->i_mtime = inode->i_atime = inode->i_ctime = current_time;
-    raw_inode.i_atime = (inode->i_atime.tv_sec);
-	raw_inode.i_ctime = (inode->i_ctime.tv_sec);
-	raw_inode.i_mtime = (inode->i_mtime.tv_sec);
+    inode->i_mtime = inode->i_atime = inode->i_ctime = current_time(inode);
     
-    raw_inode.mode = mode;
+    hi->blocks = 0;
+    hi->dir_children_count = 0;
     if(S_ISDIR(mode)) {
         inode->i_size = 1;
-        inode->i_blocks = 1;    
         inode->i_fop = &HUST_fs_dir_ops;
         
-        raw_inode.blocks = 1;
-        raw_inode.dir_children_count = 2;
-        
         //2. write block
-        if(disk_sb->free_blocks <= 0){
-            return -ENOSPC;
-        }        
-        struct HUST_dir_record dir_arr[2];
-        uint64_t first_empty_block_num = HUST_fs_get_empty_block(sb);
-        raw_inode.block[0] = first_empty_block_num;
-        const char* cur_dir = ".";
-        const char* parent_dir = "..";
-        memcpy(dir_arr[0].filename, cur_dir, strlen(cur_dir) + 1);
-        dir_arr[0].inode_no = first_empty_inode_num;
-        memcpy(dir_arr[1].filename, parent_dir, strlen(parent_dir) + 1);
-        dir_arr[2].inode_no = dir->i_ino;    
-        save_inode(sb, raw_inode);
-        save_block(sb, first_empty_block_num, dir_arr, sizeof(struct HUST_dir_record)*2);
-        set_and_save_bmap(sb, first_empty_block_num, 1);
-        
-        //update dir
-        disk_sb->free_blocks-=1;
+        err = HUST_dir_make_empty(inode, dir);
+        if(err) {
+            goto out_iput;
+        }
     }
     else if(S_ISREG(mode)) {
         inode->i_size = 0;
         inode->i_blocks = 0;
         inode->i_fop = &HUST_fs_file_ops;
         inode->i_mapping->a_ops = &HUST_fs_aops;
-        raw_inode.blocks = 0;
-        raw_inode.file_size = 0;
-        
-        //write inode
-        save_inode(sb, raw_inode);
     }
-    struct HUST_dir_record new_dir;
-    memcpy(new_dir.filename, name, strlen(name)+1);
-    new_dir.inode_no = first_empty_inode_num;
-    struct buffer_head* bh;
-    bh = sb_bread(sb, H_dir_inode.block[0]);
-    memcpy(bh->b_data + H_dir_inode.dir_children_count*sizeof(struct HUST_dir_record), &new_dir, sizeof(new_dir));
-    map_bh(bh, sb, H_dir_inode.block[0]);
-    brelse(bh);
+    err = HUST_dir_add_entry(dir, &dentry->d_name, first_empty_inode_num, mode);
+    if(err) {
+        goto out_iput;
+    }
+    HUST_dircache_add(dir, &dentry->d_name);
         
     //updata dir inode
-    H_dir_inode.dir_children_count += 1;
-    save_inode(sb, H_dir_inode);
+    dir_hi->dir_children_count += 1;
+    dir->i_mtime = dir->i_ctime = current_time(dir);
+    inode_inc_iversion(dir);
         
-    set_and_save_imap(sb, first_empty_inode_num, 1);
+    /*
+     * Both inodes reach the table through HUST_write_inode(), or right
+     * away through HUST_fs_dirty_inode() into this transaction.
+     */
     insert_inode_hash(inode);
     mark_inode_dirty(inode);
     mark_inode_dirty(dir);
     d_instantiate(dentry, inode);
-    printk(KERN_ERR "first_empty_inode_num is %llu\n", first_empty_inode_num);
-    return 0;
+    err = HUST_journal_stop(handle);
+    trace_create(dir, dentry, first_empty_inode_num, mode, err);
+    HUST_stat_latency(sb, HUST_LAT_CREATE, start);
+    return err;
+
+out_iput:
+    /* give back the first block of a new directory */
+    if(hi->blocks) {
+        uint64_t blk;
+
+        if(!HUST_fs_bmap(inode, 0, &blk))
+            HUST_fs_release_block(sb, blk);
+        hi->blocks = 0;
+        inode->i_blocks = 0;
+    }
+    /* evicting it releases the inode number */
+    clear_nlink(inode);
+    iput(inode);
+    goto out_stop;
+out_ifree:
+    HUST_fs_release_inode(sb, first_empty_inode_num);
+out_stop:
+    HUST_journal_stop(handle);
+    trace_create(dir, dentry, 0, mode, err);
+    HUST_stat_latency(sb, HUST_LAT_CREATE, start);
+    return err;
+}
+
+/*
+ * Inode number to table position.  Each group owns a slice of the inode
+ * table and both formats pack a whole number of inodes per block, so a
+ * record never straddles two table blocks.
+ */
+static int HUST_fs_inode_location(struct super_block *sb, uint64_t inode_no,
+				  uint64_t *block, unsigned int *offset)
+{
+	struct HUST_sb_info *sbi = HUST_SB(sb);
+	unsigned int isize = HUST_inode_size(sb);
+	unsigned int per_block = HUST_BLOCK_SIZE(sb) / isize;
+	uint64_t group, idx;
+
+	if (inode_no >= sbi->s_disk->inodes_count) {
+		printk(KERN_ERR "HUST: inode [%llu] out of range\n", inode_no);
+		return -1;
+	}
+	group = inode_no / sbi->s_inodes_per_group;
+	idx = inode_no % sbi->s_inodes_per_group;
+	*block = sbi->s_gd[group].itable_block + idx / per_block;
+	*offset = (idx % per_block) * isize;
+	return 0;
+}
+
+static void HUST_fs_decode_inode_v2(struct HUST_inode *raw_inode,
+				    const struct HUST_inode_v2 *disk)
+{
+	int i;
+
+	memset(raw_inode, 0, sizeof(*raw_inode));
+	raw_inode->mode = disk->mode;
+	raw_inode->inode_no = disk->inode_no;
+	raw_inode->blocks = disk->blocks;
+	for (i = 0; i < HUST_N_BLOCKS; i++)
+		raw_inode->block[i] = disk->block[i];
+	raw_inode->file_size = disk->file_size;
+	raw_inode->i_uid = disk->i_uid;
+	raw_inode->i_gid = disk->i_gid;
+	raw_inode->i_nlink = disk->i_nlink;
+	raw_inode->i_atime = disk->i_atime;
+	raw_inode->i_mtime = disk->i_mtime;
+	raw_inode->i_ctime = disk->i_ctime;
+	raw_inode->i_atime_nsec = disk->i_atime_nsec;
+	raw_inode->i_mtime_nsec = disk->i_mtime_nsec;
+	raw_inode->i_ctime_nsec = disk->i_ctime_nsec;
+	raw_inode->i_flags = disk->i_flags;
+}
+
+static void HUST_fs_encode_inode_v2(struct HUST_inode_v2 *disk,
+				    const struct HUST_inode *raw_inode)
+{
+	int i;
+
+	memset(disk, 0, sizeof(*disk));
+	disk->mode = raw_inode->mode;
+	disk->inode_no = raw_inode->inode_no;
+	disk->blocks = raw_inode->blocks;
+	for (i = 0; i < HUST_N_BLOCKS; i++)
+		disk->block[i] = raw_inode->block[i];
+	disk->file_size = raw_inode->file_size;
+	disk->i_uid = raw_inode->i_uid;
+	disk->i_gid = raw_inode->i_gid;
+	disk->i_nlink = raw_inode->i_nlink;
+	disk->i_atime = raw_inode->i_atime;
+	disk->i_mtime = raw_inode->i_mtime;
+	disk->i_ctime = raw_inode->i_ctime;
+	disk->i_atime_nsec = raw_inode->i_atime_nsec;
+	disk->i_mtime_nsec = raw_inode->i_mtime_nsec;
+	disk->i_ctime_nsec = raw_inode->i_ctime_nsec;
+	disk->i_flags = raw_inode->i_flags;
+}
+
+/*
+ * Queue a read of the table block of @inode_no unless it is *@last, the
+ * block queued just before.  readdir calls this for every name it hands
+ * out, so the stat() that usually follows finds the inode cached.
+ */
+void HUST_fs_inode_readahead(struct super_block *sb, uint64_t inode_no,
+			     uint64_t *last)
+{
+	uint64_t block;
+	unsigned int offset;
+
+	if (inode_no >= HUST_SB(sb)->s_disk->inodes_count ||
+	    HUST_fs_inode_location(sb, inode_no, &block, &offset) ||
+	    block == *last)
+		return;
+	*last = block;
+	if (!HUST_fs_itable_uninit(sb, inode_no / HUST_SB(sb)->s_inodes_per_group))
+		sb_breadahead(sb, block);
+}
+
+/*
+ * @block of the inode table is not cached: read it together with the
+ * blocks after it in the same group, whose inodes were most likely
+ * created alongside and get looked up next.
+ */
+static void HUST_fs_itable_readahead(struct super_block *sb, uint64_t group,
+				     uint64_t block)
+{
+	struct HUST_group_desc *gd = &HUST_SB(sb)->s_gd[group];
+	uint64_t end = min_t(uint64_t, gd->itable_block + gd->itable_blocks,
+			     block + 1 + HUST_SB(sb)->s_opts.inode_readahead);
+	struct blk_plug plug;
+
+	blk_start_plug(&plug);
+	for (; block < end; block++)
+		sb_breadahead(sb, block);
+	blk_finish_plug(&plug);
 }
 
 int HUST_fs_get_inode(struct super_block *sb,
@@ -297,153 +537,227 @@ int HUST_fs_get_inode(struct super_block *sb,
 		printk(KERN_ERR "inode is null");
 		return -1;
 	}
-	struct HUST_fs_super_block *H_sb = sb->s_fs_info;
-	struct HUST_inode *H_inode_array = NULL;
+	struct HUST_fs_super_block *H_sb = HUST_SB(sb)->s_disk;
+	uint64_t block;
+	unsigned int offset;
 
-	int i;
-	struct buffer_head *bh;
-	bh = sb_bread(sb,
-		      H_sb->inode_table_block
-		      + inode_no * sizeof(struct HUST_inode) / HUST_BLOCKSIZE);
-	printk(KERN_INFO "H_sb->inode_table_block is %lld",
-	       H_sb->inode_table_block);
-	BUG_ON(!bh);
-	//TODO 
-	H_inode_array = (struct HUST_inode *)bh->b_data;
-	int idx = inode_no % (HUST_BLOCKSIZE / sizeof(struct HUST_inode));
-	ssize_t inode_array_size = HUST_BLOCKSIZE / sizeof(struct HUST_inode);
-	if (idx > inode_array_size) {
-		printk(KERN_ERR "in get_inode: out of index");
+	if (HUST_fs_inode_location(sb, inode_no, &block, &offset))
 		return -1;
+	if (HUST_fs_itable_uninit(sb, inode_no / HUST_SB(sb)->s_inodes_per_group)) {
+		/* not zeroed on disk yet, but by definition all zero */
+		memset(raw_inode, 0, sizeof(*raw_inode));
+		trace_get_inode(sb, inode_no, 0);
+		return 0;
 	}
-	memcpy(raw_inode, H_inode_array + idx, sizeof(struct HUST_inode));
+
+	struct buffer_head *bh;
+	bh = sb_find_get_block(sb, block);
+	if (!bh || !buffer_uptodate(bh))
+		HUST_fs_itable_readahead(sb, inode_no / HUST_SB(sb)->s_inodes_per_group,
+					 block);
+	brelse(bh);
+	HUST_stat_inc(sb, HUST_STAT_ITABLE_READS);
+	bh = HUST_sb_bread(sb, block);
+	trace_get_inode(sb, inode_no, block);
+	if (!bh)
+		return -1;
+	if (H_sb->version >= HUST_VERSION_2)
+		HUST_fs_decode_inode_v2(raw_inode,
+			(struct HUST_inode_v2 *)(bh->b_data + offset));
+	else
+		memcpy(raw_inode, bh->b_data + offset, sizeof(struct HUST_inode));
+	brelse(bh);
 	if (raw_inode->inode_no != inode_no) {
 		printk(KERN_ERR "inode not init");
 	}
 	return 0;
 }
 
-void HUST_fs_convert_inode(struct HUST_inode *H_inode, struct inode *vfs_inode)
+static void HUST_fs_decode_time(struct timespec *ts, int64_t sec, uint32_t nsec)
+{
+	ts->tv_sec = sec;
+	/* images from older mkfs may carry garbage in the old padding */
+	ts->tv_nsec = nsec < NSEC_PER_SEC ? nsec : 0;
+}
+
+static void HUST_fs_convert_inode(struct HUST_inode *H_inode, struct inode *vfs_inode)
 {
+	struct HUST_inode_info *hi = HUST_I(vfs_inode);
+
 	vfs_inode->i_ino = H_inode->inode_no;
 	vfs_inode->i_mode = H_inode->mode;
 	vfs_inode->i_size = H_inode->file_size;
     set_nlink(vfs_inode, H_inode->i_nlink);
     i_uid_write(vfs_inode, H_inode->i_uid);
     i_gid_write(vfs_inode, H_inode->i_gid);
-    vfs_inode->i_atime.tv_sec = H_inode->i_atime;
-    vfs_inode->i_ctime.tv_sec = H_inode->i_ctime;
-    vfs_inode->i_mtime.tv_sec = H_inode->i_mtime;
-    
-	//vfs_inode->i_private = *H_inode;
+    HUST_fs_decode_time(&vfs_inode->i_atime, H_inode->i_atime, H_inode->i_atime_nsec);
+    HUST_fs_decode_time(&vfs_inode->i_ctime, H_inode->i_ctime, H_inode->i_ctime_nsec);
+    HUST_fs_decode_time(&vfs_inode->i_mtime, H_inode->i_mtime, H_inode->i_mtime_nsec);
+
+	hi->blocks = min_t(uint64_t, H_inode->blocks,
+			   HUST_fs_max_blocks(vfs_inode->i_sb));
+	memcpy(hi->block, H_inode->block, sizeof(hi->block));
+	hi->dir_children_count = S_ISDIR(H_inode->mode) ?
+	    H_inode->dir_children_count : 0;
+	hi->i_flags = H_inode->i_flags;
+	vfs_inode->i_blocks = hi->blocks * (HUST_BLOCK_SIZE(vfs_inode->i_sb) >> 9);
+
+	vfs_inode->i_op = &HUST_fs_inode_ops;
+	if (S_ISDIR(H_inode->mode)) {
+		vfs_inode->i_fop = &HUST_fs_dir_ops;
+	} else if (S_ISREG(H_inode->mode)) {
+		vfs_inode->i_fop = &HUST_fs_file_ops;
+		vfs_inode->i_mapping->a_ops = &HUST_fs_aops;
+	}
 }
 
-struct dentry *HUST_fs_lookup(struct inode *parent_inode,
-			      struct dentry *child_dentry, unsigned int flags)
+void HUST_fs_fill_raw_inode(struct inode *inode, struct HUST_inode *raw_inode)
 {
-	struct super_block *sb = parent_inode->i_sb;
-	struct HUST_inode H_inode;
-	struct inode *inode = NULL;
-	uint64_t data_block = 0, i;
-	struct HUST_dir_record *dtptr;
-	struct buffer_head *bh;
+	struct HUST_inode_info *hi = HUST_I(inode);
 
-	printk(KERN_ERR "HUST_fs: lookup [%s] in inode [%lu]\n",
-	       child_dentry->d_name.name, parent_inode->i_ino);
+	memset(raw_inode, 0, sizeof(*raw_inode));
+	raw_inode->mode = inode->i_mode;
+	raw_inode->inode_no = inode->i_ino;
+	raw_inode->blocks = hi->blocks;
+	memcpy(raw_inode->block, hi->block, sizeof(raw_inode->block));
+	if (S_ISDIR(inode->i_mode))
+		raw_inode->dir_children_count = hi->dir_children_count;
+	else
+		raw_inode->file_size = inode->i_size;
+	raw_inode->i_uid = i_uid_read(inode);
+	raw_inode->i_gid = i_gid_read(inode);
+	raw_inode->i_nlink = inode->i_nlink;
+	raw_inode->i_atime = inode->i_atime.tv_sec;
+	raw_inode->i_mtime = inode->i_mtime.tv_sec;
+	raw_inode->i_ctime = inode->i_ctime.tv_sec;
+	raw_inode->i_atime_nsec = inode->i_atime.tv_nsec;
+	raw_inode->i_mtime_nsec = inode->i_mtime.tv_nsec;
+	raw_inode->i_ctime_nsec = inode->i_ctime.tv_nsec;
+	raw_inode->i_flags = hi->i_flags;
+}
 
-	if (-1 == HUST_fs_get_inode(sb, parent_inode->i_ino, &H_inode)){
-		printk(KERN_ERR "HUST: cannot get inode\n");
-		return ERR_PTR(-EFAULT);
+struct inode *HUST_fs_iget(struct super_block *sb, uint64_t inode_no)
+{
+	struct HUST_inode raw_inode;
+	struct inode *inode;
+
+	inode = iget_locked(sb, inode_no);
+	if (!inode)
+		return ERR_PTR(-ENOMEM);
+	if (!(inode->i_state & I_NEW))
+		return inode;
+
+	/* the only inode table read for this inode while it stays cached */
+	if (-1 == HUST_fs_get_inode(sb, inode_no, &raw_inode)) {
+		iget_failed(inode);
+		return ERR_PTR(-EIO);
 	}
+	HUST_fs_convert_inode(&raw_inode, inode);
+	unlock_new_inode(inode);
+	return inode;
+}
 
-	data_block = H_inode.block[0];
-	bh = sb_bread(sb, data_block);
-	if (!bh) {
-		printk(KERN_ERR
-		       "1bfs lookup: Could not read data block [%llu]\n",
-		       data_block);
-		return ERR_PTR(-EFAULT);
+static struct dentry *HUST_fs_do_lookup(struct inode *parent_inode,
+					struct dentry *child_dentry)
+{
+	struct super_block *sb = parent_inode->i_sb;
+	struct inode *inode = NULL;
+	struct HUST_dirent de;
+	struct buffer_head *bh;
+	int ret;
+
+	/* a name the cache has never seen needs no block reads */
+	if (HUST_dircache_lookup(parent_inode, &child_dentry->d_name) == -ENOENT) {
+		trace_lookup(parent_inode, child_dentry, 0, 1, -ENOENT);
+		HUST_stat_inc(sb, HUST_STAT_LOOKUP_MISS);
+		d_add(child_dentry, NULL);
+		return NULL;
 	}
 
-	dtptr = (struct HUST_dir_record *)bh->b_data;
-
-	for (i = 0; i < H_inode.dir_children_count; i++) {
-		printk(KERN_ERR "child_dentry is %s and file name is %s\n", child_dentry->d_name.name, dtptr[i].filename);
-		if (strncmp
-		    (child_dentry->d_name.name, dtptr[i].filename,
-		     HUST_FILENAME_MAX_LEN) == 0) {
-
-					printk(KERN_ERR "in case 1");
-			inode = iget_locked(sb, dtptr[i].inode_no);
-			if (!inode) {
-				printk(KERN_ERR
-				       "HUST_fs lookup: iget_locked() returned NULL\n");
-				brelse(bh);
-				return ERR_PTR(-EFAULT);
-			}
-
-			if (inode->i_state & I_NEW) {
-				inode_init_owner(inode, parent_inode, 0);
-
-				struct HUST_inode H_child_inode;
-				if (-1 == HUST_fs_get_inode(sb, dtptr[i].inode_no, &H_child_inode))
-				{
-					return ERR_PTR(-EFAULT);
-				}
-
-				HUST_fs_convert_inode(&H_child_inode, inode);
-                printk(KERN_ERR "uid is %lu and gid is %lu", inode->i_uid, inode->i_gid);
-				inode->i_op = &HUST_fs_inode_ops;
-
-				if (S_ISDIR(H_child_inode.mode)) {
-					inode->i_fop = &HUST_fs_dir_ops;
-				} else if (S_ISREG(H_child_inode.mode)) {
-					inode->i_fop = &HUST_fs_file_ops;;
-					inode->i_mapping->a_ops = &HUST_fs_aops;
-				}
-				inode->i_mode = H_child_inode.mode;
-                inode->i_size = H_child_inode.file_size;
-				insert_inode_hash(inode);
-				printk(KERN_ERR "inode->i_sb is %llu and sb is %llu\n", (uint64_t) inode->i_sb, (uint64_t)sb);
-				unlock_new_inode(inode);
-			}
-
-			d_add(child_dentry, inode);
-			brelse(bh);
-
-	printk(KERN_ERR "lookup over at a\n");
-			return NULL;
+	ret = HUST_dir_find_entry(parent_inode, &child_dentry->d_name, &de, &bh);
+	trace_lookup(parent_inode, child_dentry, ret ? 0 : de.inode_no,
+			     0, ret);
+	if (ret && ret != -ENOENT)
+		return ERR_PTR(ret);
+	HUST_stat_inc(sb, ret ? HUST_STAT_LOOKUP_MISS : HUST_STAT_LOOKUP_HIT);
+	if (!ret) {
+		brelse(bh);
+		inode = HUST_fs_iget(sb, de.inode_no);
+		if (IS_ERR(inode)) {
+			printk(KERN_ERR
+			       "HUST_fs lookup: HUST_fs_iget() failed\n");
+			return ERR_CAST(inode);
 		}
 	}
 
-	d_add(child_dentry, NULL);
-	brelse(bh);
-	printk(KERN_ERR "lookup over\n");
+	d_add(child_dentry, inode);
 	return NULL;
 }
 
-int save_inode(struct super_block* sb, struct HUST_inode H_inode)
+struct dentry *HUST_fs_lookup(struct inode *parent_inode,
+			      struct dentry *child_dentry, unsigned int flags)
 {
-    uint64_t inode_num = H_inode.inode_no;
-    struct HUST_fs_super_block *disk_sb = sb->s_fs_info;
-    uint64_t block_idx = inode_num*sizeof(struct HUST_inode) / HUST_BLOCKSIZE 
-        + disk_sb->inode_table_block ;
-    uint64_t arr_off = inode_num % (HUST_BLOCKSIZE / sizeof(struct HUST_inode));
+	u64 start = ktime_get_ns();
+	struct dentry *ret;
+
+	ret = HUST_fs_do_lookup(parent_inode, child_dentry);
+	HUST_stat_latency(parent_inode->i_sb, HUST_LAT_LOOKUP, start);
+	return ret;
+}
+
+/*
+ * Encode @H_inode into its inode table block and mark the block dirty.
+ * Returns the buffer with a reference held.
+ */
+struct buffer_head *HUST_fs_update_inode(struct super_block *sb,
+					 const struct HUST_inode *H_inode)
+{
+    uint64_t inode_num = H_inode->inode_no;
+    struct HUST_fs_super_block *disk_sb = HUST_SB(sb)->s_disk;
+    uint64_t block_idx;
+    unsigned int offset;
+    int err;
+
+    if (HUST_fs_inode_location(sb, inode_num, &block_idx, &offset))
+        return ERR_PTR(-EINVAL);
     
     //1. read disk inode
     struct buffer_head* bh;
-    bh = sb_bread(sb, block_idx);
-    printk(KERN_ERR "In save inode and inode_no is %llu and block_idx is %llu and bh is %llu\n", 
-           inode_num, block_idx, sb);
-    BUG_ON(!bh);
+    bh = HUST_sb_bread(sb, block_idx);
+    trace_save_inode(sb, inode_num, block_idx);
+    if (!bh)
+        return ERR_PTR(-EIO);
+    err = HUST_journal_get_write_access(sb, bh);
+    if (err) {
+        brelse(bh);
+        return ERR_PTR(err);
+    }
     
     //2. change disk inode, TODO:verify inode
-    struct HUST_inode* p_disk_inode;
-    p_disk_inode = (struct HUST_inode*)bh->b_data;
-    memcpy(p_disk_inode + arr_off, &H_inode, sizeof(H_inode));
+    lock_buffer(bh);
+    if (disk_sb->version >= HUST_VERSION_2)
+        HUST_fs_encode_inode_v2((struct HUST_inode_v2 *)(bh->b_data + offset),
+                                H_inode);
+    else
+        memcpy(bh->b_data + offset, H_inode, sizeof(*H_inode));
+    unlock_buffer(bh);
     
     //3. save disk inode
-    map_bh(bh, sb, block_idx);
+    err = HUST_journal_dirty_metadata(sb, bh);
+    if (err) {
+        brelse(bh);
+        return ERR_PTR(err);
+    }
+    return bh;
+}
+
+int save_inode(struct super_block* sb, struct HUST_inode H_inode)
+{
+    struct buffer_head* bh;
+
+    bh = HUST_fs_update_inode(sb, &H_inode);
+    if (IS_ERR(bh))
+        return PTR_ERR(bh);
     brelse(bh);
     return 0;
 }
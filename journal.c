@@ -0,0 +1,252 @@
+#include "constants.h"
+#include "HUST_fs.h"
+#include <linux/blkdev.h>
+
+/*
+ * Metadata journal.
+ *
+ * With HUST_FEATURE_JOURNAL mkfs reserves journal_blocks blocks at
+ * journal_block for a jbd2 log.  Every change to the bitmaps, the inode
+ * table, group descriptors, the superblock and directory or indirect
+ * blocks is made inside a jbd2 handle: one create, one unlink, one batch
+ * of blocks allocated by get_block or one inode released is one handle.
+ * jbd2 gathers the handles of all tasks into the running transaction and
+ * commits it every few seconds or when an fsync needs it, so concurrent
+ * fsyncs share a single commit and cache flush.  A transaction reaches
+ * the log before any of its blocks go home, and mount replays the log,
+ * so after a crash the metadata is as of the last commit.  File data is
+ * not logged.
+ *
+ * The helpers find the running handle through current, so code below
+ * HUST_journal_start() takes no handle argument.  Without a journal they
+ * fall back to marking the buffer dirty, see meta.c.
+ *
+ * A handle is started before alloc_mutex, s_itable_mutex or a bitmap
+ * mutex is taken, never with one held: starting may wait for a commit,
+ * which waits for every handle of the running transaction to stop.
+ */
+
+static journal_t *HUST_journal(struct super_block *sb)
+{
+	return HUST_SB(sb)->s_journal;
+}
+
+handle_t *HUST_journal_start(struct super_block *sb, int nblocks)
+{
+	if (!HUST_journal(sb))
+		return NULL;
+	/* nested in a running handle this just takes another reference */
+	return jbd2_journal_start(HUST_journal(sb), nblocks);
+}
+
+int HUST_journal_stop(handle_t *handle)
+{
+	if (!handle)
+		return 0;
+	return jbd2_journal_stop(handle);
+}
+
+static handle_t *HUST_journal_handle(void)
+{
+	handle_t *handle = journal_current_handle();
+
+	WARN_ON_ONCE(!handle);
+	return handle;
+}
+
+/* Before changing the metadata buffer @bh. */
+int HUST_journal_get_write_access(struct super_block *sb, struct buffer_head *bh)
+{
+	handle_t *handle;
+
+	if (!HUST_journal(sb))
+		return 0;
+	handle = HUST_journal_handle();
+	if (!handle)
+		return -EROFS;
+	return jbd2_journal_get_write_access(handle, bh);
+}
+
+/* Before filling in @bh, a block that was free until now. */
+int HUST_journal_get_create_access(struct super_block *sb, struct buffer_head *bh)
+{
+	handle_t *handle;
+
+	if (!HUST_journal(sb))
+		return 0;
+	handle = HUST_journal_handle();
+	if (!handle)
+		return -EROFS;
+	return jbd2_journal_get_create_access(handle, bh);
+}
+
+/* After changing @bh; takes one of the handle's credits the first time. */
+int HUST_journal_dirty_metadata(struct super_block *sb, struct buffer_head *bh)
+{
+	handle_t *handle;
+
+	if (!HUST_journal(sb)) {
+		mark_buffer_dirty(bh);
+		return 0;
+	}
+	handle = HUST_journal_handle();
+	if (!handle)
+		return -EROFS;
+	return jbd2_journal_dirty_metadata(handle, bh);
+}
+
+/*
+ * The same for a directory or indirect block of @inode, which without a
+ * journal is written along with the inode on fsync.
+ */
+int HUST_journal_dirty_inode_buffer(struct inode *inode, struct buffer_head *bh)
+{
+	if (!HUST_journal(inode->i_sb)) {
+		mark_buffer_dirty_inode(bh, inode);
+		return 0;
+	}
+	return HUST_journal_dirty_metadata(inode->i_sb, bh);
+}
+
+/*
+ * Credits for allocating @nr_blocks blocks: a bitmap block for each in
+ * the worst case, the indirect blocks and their bitmap blocks, the inode
+ * and the superblock.
+ */
+int HUST_journal_alloc_credits(struct super_block *sb, uint64_t nr_blocks)
+{
+	return nr_blocks + 2 * (DIV_ROUND_UP(nr_blocks, HUST_ADDR_PER_BLOCK(sb)) + 2) +
+	    HUST_INODE_CREDITS;
+}
+
+/* Most blocks one handle may allocate; larger extensions are split. */
+uint64_t HUST_journal_max_alloc(struct super_block *sb)
+{
+	journal_t *journal = HUST_journal(sb);
+
+	if (!journal)
+		return U64_MAX;
+	/* HUST_journal_alloc_credits() is at most 2 * nr_blocks + 8 */
+	return max_t(int, 1, (journal->j_max_transaction_buffers - 8) / 2);
+}
+
+/*
+ * Open the journal and replay it if the file system was not unmounted
+ * cleanly.  Replay writes through the block device's buffer cache, so
+ * buffers read before, like the superblock, see the replayed contents.
+ */
+int HUST_journal_load(struct super_block *sb)
+{
+	struct HUST_fs_super_block *disk_sb = HUST_SB(sb)->s_disk;
+	journal_t *journal;
+	int err;
+
+	if (!(disk_sb->features & HUST_FEATURE_JOURNAL))
+		return 0;
+	if (disk_sb->journal_blocks < HUST_JOURNAL_MIN_BLOCKS ||
+	    disk_sb->journal_blocks > INT_MAX ||
+	    disk_sb->journal_block < RESERVE_BLOCKS(sb->s_blocksize) ||
+	    disk_sb->journal_block + disk_sb->journal_blocks >
+	    disk_sb->blocks_count) {
+		printk(KERN_ERR "HUST_fs: bad journal location %llu+%llu\n",
+		       disk_sb->journal_block, disk_sb->journal_blocks);
+		return -EINVAL;
+	}
+
+	journal = jbd2_journal_init_dev(sb->s_bdev, sb->s_bdev,
+					disk_sb->journal_block,
+					disk_sb->journal_blocks, sb->s_blocksize);
+	if (!journal)
+		return -ENOMEM;
+	journal->j_private = sb;
+	/* a commit is durable only behind a cache flush */
+	journal->j_flags |= JBD2_BARRIER;
+
+	err = jbd2_journal_load(journal);
+	if (err) {
+		printk(KERN_ERR "HUST_fs: cannot load journal: %d\n", err);
+		jbd2_journal_destroy(journal);
+		return err;
+	}
+	HUST_SB(sb)->s_journal = journal;
+	return 0;
+}
+
+/* Commit what is left and write every logged block home. */
+void HUST_journal_release(struct super_block *sb)
+{
+	journal_t *journal = HUST_journal(sb);
+
+	if (!journal)
+		return;
+	if (jbd2_journal_destroy(journal) < 0)
+		printk(KERN_ERR "HUST_fs: error closing the journal\n");
+	HUST_SB(sb)->s_journal = NULL;
+}
+
+/*
+ * Wait until transaction @tid is on disk, starting its commit if it is
+ * still running.  Everyone waiting for the same @tid shares the commit.
+ */
+int HUST_journal_commit(struct super_block *sb, tid_t tid)
+{
+	if (!HUST_journal(sb))
+		return 0;
+	return jbd2_complete_transaction(HUST_journal(sb), tid);
+}
+
+/* sync_fs: commit the running transaction, waiting for it if @wait. */
+int HUST_journal_sync(struct super_block *sb, int wait)
+{
+	journal_t *journal = HUST_journal(sb);
+	tid_t target;
+
+	if (!journal)
+		return 0;
+	if (jbd2_journal_start_commit(journal, &target) && wait)
+		return jbd2_log_wait_commit(journal, target);
+	return 0;
+}
+
+/* Commit everything and write it home, leaving the log empty. */
+int HUST_journal_flush(struct super_block *sb)
+{
+	journal_t *journal = HUST_journal(sb);
+	int err;
+
+	if (!journal)
+		return 0;
+	jbd2_journal_lock_updates(journal);
+	err = jbd2_journal_flush(journal);
+	jbd2_journal_unlock_updates(journal);
+	return err;
+}
+
+/*
+ * Writing the data back logs whatever it allocated, and every change of
+ * the inode's metadata is in transaction i_sync_tid or an earlier one,
+ * so waiting for that one is enough.  When it was already committed the
+ * data written since still needs a cache flush of its own.
+ */
+int HUST_fs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+	struct inode *inode = file->f_mapping->host;
+	struct super_block *sb = inode->i_sb;
+	journal_t *journal = HUST_journal(sb);
+	bool flush;
+	tid_t tid;
+	int ret;
+
+	if (!journal)
+		return HUST_meta_fsync(file, start, end, datasync);
+
+	ret = file_write_and_wait_range(file, start, end);
+	if (ret)
+		return ret;
+	tid = READ_ONCE(HUST_I(inode)->i_sync_tid);
+	flush = !jbd2_trans_will_send_data_barrier(journal, tid);
+	ret = jbd2_complete_transaction(journal, tid);
+	if (!ret && flush)
+		ret = blkdev_issue_flush(sb->s_bdev, GFP_KERNEL, NULL);
+	return ret;
+}
@@ -1,70 +1,107 @@
 #include "constants.h"
 #include "HUST_fs.h"
+#include "HUST_trace.h"
 
 
 int checkbit(uint8_t number, int x)
 {
     return (number >> x) & 1U;
 }
-int HUST_find_first_zero_bit(const void *vaddr, unsigned size)
+/*
+ * First clear bit of the @size bits at @vaddr, or @size if there is none.
+ * Reads whole 16-bit words, so the buffer is rounded up to one.
+ */
+uint64_t HUST_find_first_zero_bit(const void *vaddr, uint64_t size)
 {
-	const unsigned short *p = vaddr, *addr = vaddr;
-	unsigned short num;
+	const unsigned short *p = vaddr;
+	uint64_t nr;
 
-	if (!size)
-		return 0;
-
-	size >>= 4;
-	while (*p++ == 0xffff) {
-		if (--size == 0)
-			return (p - addr) << 4;
+	for (nr = 0; nr < size; nr += 16, p++) {
+		if (*p != 0xffff)
+			return min(nr + ffz(*p), size);
 	}
-
-	num = *--p;
-	return ((p - addr) << 4) + ffz(num);
+	return size;
 }
-uint64_t HUST_fs_get_empty_inode(struct super_block* sb)
+/*
+ * Find a free inode and mark it used, both under s_imap_mutex so that
+ * concurrent creates never pick the same one.  Returns -ENOSPC when the
+ * inode table is full; HUST_fs_release_inode() undoes it.
+ */
+int HUST_fs_take_inode(struct super_block *sb, uint64_t *inode_no)
 {
-    struct HUST_fs_super_block *disk_sb = sb->s_fs_info;
-    //read imap
-    
-    ssize_t imap_size = disk_sb->blocks_count / 8;
-	
-	uint8_t *imap = kmalloc(imap_size, GFP_KERNEL);
-    if(0!=get_imap(sb, imap, imap_size))
-    {
-        kfree(imap);
-        return -EFAULT;
+    struct HUST_sb_info *sbi = HUST_SB(sb);
+    struct HUST_fs_super_block *disk_sb = sbi->s_disk;
+    uint64_t inodes_count, imap_bits, nr;
+    ssize_t imap_size;
+    uint8_t *imap;
+    int err;
+
+    mutex_lock(&sbi->s_imap_mutex);
+    //read imap, only the part covering the current inode table
+    inodes_count = disk_sb->inodes_count;
+    imap_bits = round_up(inodes_count, 16);
+    imap_size = imap_bits / 8;
+    imap = kvmalloc(imap_size, GFP_KERNEL);
+    if(!imap) {
+        err = -ENOMEM;
+        goto out;
     }
-	
-	uint64_t empty_ilock_num = HUST_find_first_zero_bit(imap, disk_sb->blocks_count / 8);
-	printk(KERN_INFO "HUST_find_first_zero_bit at %llu\n",
-	       empty_ilock_num);
-    kfree(imap);
-    return empty_ilock_num;
+    err = get_imap(sb, imap, imap_size);
+    if(err) {
+        kvfree(imap);
+        goto out;
+    }
+    nr = HUST_find_first_zero_bit(imap, imap_bits);
+    kvfree(imap);
+    HUST_stat_inc(sb, HUST_STAT_BITMAP_SCANS);
+    HUST_stat_add(sb, HUST_STAT_BITS_SCANNED, min(nr + 1, imap_bits));
+    if(nr >= inodes_count) {
+        err = -ENOSPC;
+        goto out;
+    }
+    err = set_and_save_imap(sb, nr, 1);
+    if(!err) {
+        percpu_counter_dec(&sbi->s_freeinodes_counter);
+        HUST_fs_super_changed(sb);
+        *inode_no = nr;
+    }
+ out:
+    mutex_unlock(&sbi->s_imap_mutex);
+    return err;
+}
+
+/* Free an inode number taken by HUST_fs_take_inode(). */
+void HUST_fs_release_inode(struct super_block *sb, uint64_t inode_no)
+{
+    if(set_and_save_imap(sb, inode_no, 0))
+        printk(KERN_ERR "HUST_fs: cannot free inode [%llu]\n", inode_no);
+    percpu_counter_inc(&HUST_SB(sb)->s_freeinodes_counter);
+    HUST_fs_super_changed(sb);
 }
 int get_imap(struct super_block* sb, uint8_t* imap, ssize_t imap_size)
 {
     if(!imap) {
         return -EFAULT;
     }
-    struct HUST_fs_super_block *disk_sb = sb->s_fs_info;
+    struct HUST_fs_super_block *disk_sb = HUST_SB(sb)->s_disk;
     //read imap
 	uint64_t i;
+	trace_read_imap(sb, imap_size);
 	for (i = disk_sb->imap_block;
 	     i < disk_sb->data_block_number && imap_size != 0; ++i) {
         
 		struct buffer_head *bh;
-		bh = sb_bread(sb, i);
+		bh = HUST_sb_bread(sb, i);
 
 		if (!bh) {
 			printk(KERN_ERR "bh empty\n");
+            return -EIO;
 		}
 		uint8_t *imap_t = (uint8_t *) bh->b_data;
-		printk(KERN_INFO "imap is %x\n", imap_t[0]);
-		if (imap_size >= HUST_BLOCKSIZE) {
-			memcpy(imap, imap_t, HUST_BLOCKSIZE);
-			imap_size -= HUST_BLOCKSIZE;
+		if (imap_size >= HUST_BLOCK_SIZE(sb)) {
+			memcpy(imap, imap_t, HUST_BLOCK_SIZE(sb));
+			imap += HUST_BLOCK_SIZE(sb);
+			imap_size -= HUST_BLOCK_SIZE(sb);
 		} else {
 			memcpy(imap, imap_t, imap_size);
 			imap_size = 0;
@@ -78,21 +115,23 @@ int get_bmap(struct super_block* sb, uint8_t* bmap, ssize_t bmap_size)
     if(!bmap) {
         return -EFAULT;
     }
-    struct HUST_fs_super_block *disk_sb = sb->s_fs_info;
+    struct HUST_fs_super_block *disk_sb = HUST_SB(sb)->s_disk;
 	
 	uint64_t i;
+	trace_read_bmap(sb, bmap_size);
 	for (i = disk_sb->bmap_block;
 	     i < disk_sb->imap_block && bmap_size != 0; ++i) {
 		struct buffer_head *bh;
-		bh = sb_bread(sb, i);
+		bh = HUST_sb_bread(sb, i);
 		if (!bh) {
 			printk(KERN_ERR "bh empty\n");
             return -EFAULT;
 		}
 		uint8_t *bmap_t = (uint8_t *) bh->b_data;
-		if (bmap_size >= HUST_BLOCKSIZE) {
-			memcpy(bmap, bmap_t, HUST_BLOCKSIZE);
-			bmap_size -= HUST_BLOCKSIZE;
+		if (bmap_size >= HUST_BLOCK_SIZE(sb)) {
+			memcpy(bmap, bmap_t, HUST_BLOCK_SIZE(sb));
+			bmap += HUST_BLOCK_SIZE(sb);
+			bmap_size -= HUST_BLOCK_SIZE(sb);
 		} else {
 			memcpy(bmap, bmap_t, bmap_size);
 			bmap_size = 0;
@@ -103,19 +142,16 @@ int get_bmap(struct super_block* sb, uint8_t* bmap, ssize_t bmap_size)
 }
 uint64_t HUST_fs_get_empty_block(struct super_block* sb)
 {
-	struct HUST_fs_super_block *disk_sb = sb->s_fs_info;
+	struct HUST_fs_super_block *disk_sb = HUST_SB(sb)->s_disk;
 	
 	//read imap
 	uint64_t bmap_empty = disk_sb->blocks_count / 8;
-	printk(KERN_INFO "bmap_empty is %llu\n", bmap_empty);
 	uint8_t *bmap = kmalloc(bmap_empty, GFP_KERNEL);
     if(get_bmap(sb, bmap, bmap_empty)!=0) {
         kfree(bmap);
         return -EFAULT;
     }
 	uint64_t empty_block_num = HUST_find_first_zero_bit(bmap, disk_sb->blocks_count / 8);
-	printk(KERN_INFO "HUST_find_first_zero_bit at %llu\n",
-	       empty_block_num);
     kfree(bmap);
     return empty_block_num;
 }
@@ -127,16 +163,24 @@ int set_and_save_imap(struct super_block* sb, uint64_t inode_num, uint8_t value)
      * 2. write the block
      */
 	
-    struct HUST_fs_super_block *disk_sb = sb->s_fs_info;
-    uint64_t block_idx = inode_num / (HUST_BLOCKSIZE*8) + disk_sb->imap_block;
-    uint64_t bit_off = inode_num % (HUST_BLOCKSIZE*8);
+    struct HUST_fs_super_block *disk_sb = HUST_SB(sb)->s_disk;
+    uint64_t block_idx = inode_num / HUST_BITS_PER_BLOCK(sb) + disk_sb->imap_block;
+    uint64_t bit_off = inode_num % HUST_BITS_PER_BLOCK(sb);
     
     struct buffer_head* bh;
-    bh = sb_bread(sb, block_idx);
+    int err;
+    bh = HUST_sb_bread(sb, block_idx);
     
-    printk(KERN_ERR "In save imap\n");
+    trace_set_imap(sb, inode_num, value);
     
     BUG_ON(!bh);
+    err = HUST_journal_get_write_access(sb, bh);
+    if(err) {
+        brelse(bh);
+        return err;
+    }
+    /* a release changes bits without the bitmap mutex */
+    lock_buffer(bh);
     if(value == 1){
         setbit(bh->b_data[bit_off/8], bit_off%8);
     }
@@ -146,23 +190,51 @@ int set_and_save_imap(struct super_block* sb, uint64_t inode_num, uint8_t value)
     else{
         printk(KERN_ERR "value error\n");
     }
-    map_bh(bh, sb, block_idx);
+    unlock_buffer(bh);
+    err = HUST_journal_dirty_metadata(sb, bh);
     brelse(bh);
-    return 0;
+    return err;
 }
-int save_bmap(struct super_block* sb, uint8_t* bmap, ssize_t bmap_size)
+/*
+ * Write back a bmap read by get_bmap(); only changed blocks are dirtied,
+ * and remembered for the fsync of @owner, whose alloc_mutex is held.
+ * The caller holds s_bmap_mutex from get_bmap() to here.
+ */
+int save_bmap(struct super_block* sb, uint8_t* bmap, ssize_t bmap_size,
+              struct inode *owner)
 {
-    struct HUST_fs_super_block *disk_sb = sb->s_fs_info;
-    uint64_t block_idx = disk_sb->bmap_block;
-    struct buffer_head* bh;
-    bh = sb_bread(sb, block_idx);
-    
-    printk(KERN_ERR "In save bmap\n");
-    memcpy(bh->b_data, bmap, bmap_size);
-    
-    map_bh(bh, sb, block_idx);
-    brelse(bh);
-    return 0;
+    struct HUST_fs_super_block *disk_sb = HUST_SB(sb)->s_disk;
+    unsigned int dirtied = 0;
+    uint64_t i;
+    int err = 0;
+
+    for (i = disk_sb->bmap_block;
+         i < disk_sb->imap_block && bmap_size > 0 && !err; ++i) {
+        ssize_t len = min_t(ssize_t, bmap_size, HUST_BLOCK_SIZE(sb));
+        struct buffer_head* bh;
+
+        bh = HUST_sb_bread(sb, i);
+        if (!bh) {
+            return -EIO;
+        }
+        if (memcmp(bh->b_data, bmap, len)) {
+            err = HUST_journal_get_write_access(sb, bh);
+            if (!err) {
+                lock_buffer(bh);
+                memcpy(bh->b_data, bmap, len);
+                unlock_buffer(bh);
+                err = HUST_journal_dirty_metadata(sb, bh);
+            }
+            if (!err && owner)
+                HUST_meta_note_bmap(owner, i - disk_sb->bmap_block);
+            dirtied++;
+        }
+        brelse(bh);
+        bmap += len;
+        bmap_size -= len;
+    }
+    trace_save_bmap(sb, dirtied, err);
+    return err;
 }
 int set_and_save_bmap(struct super_block* sb, uint64_t block_num, uint8_t value)
 {
@@ -170,16 +242,24 @@ int set_and_save_bmap(struct super_block* sb, uint64_t block_num, uint8_t value)
      * 1. find one block we want to change;
      * 2. write the block
      */
-    struct HUST_fs_super_block *disk_sb = sb->s_fs_info;
-    uint64_t block_idx = block_num / (HUST_BLOCKSIZE*8) + disk_sb->bmap_block;
-    uint64_t bit_off = block_num % (HUST_BLOCKSIZE*8);
+    struct HUST_fs_super_block *disk_sb = HUST_SB(sb)->s_disk;
+    uint64_t block_idx = block_num / HUST_BITS_PER_BLOCK(sb) + disk_sb->bmap_block;
+    uint64_t bit_off = block_num % HUST_BITS_PER_BLOCK(sb);
     
     struct buffer_head* bh;
-    bh = sb_bread(sb, block_idx);
+    int err;
+    bh = HUST_sb_bread(sb, block_idx);
     
-    printk(KERN_ERR "In save bmap\n");
+    trace_set_bmap(sb, block_num, value);
     
     BUG_ON(!bh);
+    err = HUST_journal_get_write_access(sb, bh);
+    if(err) {
+        brelse(bh);
+        return err;
+    }
+    /* a release changes bits without the bitmap mutex */
+    lock_buffer(bh);
     if(value == 1){
         setbit(bh->b_data[bit_off/8], bit_off%8);
     }
@@ -189,7 +269,122 @@ int set_and_save_bmap(struct super_block* sb, uint64_t block_num, uint8_t value)
     else{
         printk(KERN_ERR "value error\n");
     }
-    map_bh(bh, sb, block_idx);
+    unlock_buffer(bh);
+    err = HUST_journal_dirty_metadata(sb, bh);
     brelse(bh);
+    return err;
+}
+
+/* Free block @blk of a create that failed half way. */
+void HUST_fs_release_block(struct super_block *sb, uint64_t blk)
+{
+    struct HUST_sb_info *sbi = HUST_SB(sb);
+
+    mutex_lock(&sbi->s_bmap_mutex);
+    if(set_and_save_bmap(sb, blk, 0))
+        printk(KERN_ERR "HUST_fs: cannot free block %llu\n", blk);
+    else
+        percpu_counter_inc(&sbi->s_freeblocks_counter);
+    mutex_unlock(&sbi->s_bmap_mutex);
+    HUST_fs_super_changed(sb);
+}
+
+/*
+ * Find and mark a run of @count free blocks, for metadata that has to be
+ * contiguous, under s_bmap_mutex.  Returns the first block of the run.
+ */
+int HUST_fs_alloc_contig_blocks(struct super_block* sb, uint64_t count, uint64_t* start)
+{
+    struct HUST_sb_info *sbi = HUST_SB(sb);
+    struct HUST_fs_super_block *disk_sb = sbi->s_disk;
+    ssize_t bmap_size;
+    uint64_t i, run = 0, nbits;
+    uint8_t *bmap;
+    int err = 0;
+
+    if(count == 0 ||
+       percpu_counter_read_positive(&sbi->s_freeblocks_counter) < count) {
+        HUST_stat_inc(sb, HUST_STAT_ALLOC_FAIL);
+        return -ENOSPC;
+    }
+    mutex_lock(&sbi->s_bmap_mutex);
+    nbits = disk_sb->blocks_count;
+    bmap_size = DIV_ROUND_UP(nbits, 8);
+    bmap = kvmalloc(bmap_size, GFP_KERNEL);
+    if(!bmap) {
+        err = -ENOMEM;
+        goto out;
+    }
+    if(get_bmap(sb, bmap, bmap_size)) {
+        kvfree(bmap);
+        err = -EIO;
+        goto out;
+    }
+    for(i = disk_sb->data_block_number; i < nbits; ++i) {
+        if(checkbit(bmap[i/8], i%8)) {
+            run = 0;
+            continue;
+        }
+        if(++run == count)
+            break;
+    }
+    kvfree(bmap);
+    HUST_stat_inc(sb, HUST_STAT_BITMAP_SCANS);
+    HUST_stat_add(sb, HUST_STAT_BITS_SCANNED,
+                  min(i + 1, nbits) -
+                  disk_sb->data_block_number);
+    if(run != count) {
+        err = -ENOSPC;
+        goto out;
+    }
+    *start = i + 1 - count;
+    for(i = *start; i < *start + count; ++i) {
+        err = set_and_save_bmap(sb, i, 1);
+        if(err)
+            break;
+    }
+    percpu_counter_sub(&sbi->s_freeblocks_counter, i - *start);
+    HUST_fs_super_changed(sb);
+ out:
+    mutex_unlock(&sbi->s_bmap_mutex);
+    HUST_stat_inc(sb, err ? HUST_STAT_ALLOC_FAIL : HUST_STAT_ALLOC_OK);
+    trace_alloc_contig(sb, count, err ? 0 : *start, err);
+    return err;
+}
+
+/* Clear bits among the first @nbits of the bitmap at @block. */
+static int HUST_fs_count_zero_bits(struct super_block *sb, uint64_t block,
+                                   uint64_t nbits, uint64_t *zero)
+{
+    uint64_t used = 0, bits, i;
+
+    *zero = nbits;
+    for (; nbits; block++, nbits -= bits) {
+        struct buffer_head *bh = HUST_sb_bread(sb, block);
+
+        if (!bh)
+            return -EIO;
+        bits = min_t(uint64_t, nbits, HUST_BITS_PER_BLOCK(sb));
+        used += memweight(bh->b_data, bits / 8);
+        for (i = round_down(bits, 8); i < bits; ++i)
+            used += checkbit(bh->b_data[i/8], i%8);
+        brelse(bh);
+    }
+    *zero -= used;
     return 0;
 }
+
+/* Recompute the free counts from the bitmaps, for an unclean mount. */
+int HUST_fs_count_free(struct super_block *sb, uint64_t *free_blocks,
+                       uint64_t *free_inodes)
+{
+    struct HUST_fs_super_block *disk_sb = HUST_SB(sb)->s_disk;
+    int err;
+
+    err = HUST_fs_count_zero_bits(sb, disk_sb->bmap_block,
+                                  disk_sb->blocks_count, free_blocks);
+    if (!err)
+        err = HUST_fs_count_zero_bits(sb, disk_sb->imap_block,
+                                      disk_sb->inodes_count, free_inodes);
+    return err;
+}
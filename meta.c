@@ -0,0 +1,160 @@
+#include "constants.h"
+#include "HUST_fs.h"
+#include <linux/blkdev.h>
+#include <linux/sort.h>
+
+/*
+ * Metadata writeback without a journal.
+ *
+ * Every metadata change leaves its buffer dirty in the block device's
+ * cache.  Bitmaps, group descriptors, the superblock and the inode table
+ * are shared and go home with the block device's own writeback, which
+ * walks them in block order.  Directory and indirect blocks belong to
+ * one inode and are also put on that inode's list of buffers
+ * (mark_buffer_dirty_inode), so writing the inode for data integrity
+ * can take them along instead of waiting for the whole device.  The
+ * block bitmap blocks an inode's allocations changed are remembered as
+ * a range in the inode for fsync.
+ *
+ * Such a flush sorts the shared buffers by block number and submits them
+ * under one plug, so neighbouring blocks reach the disk as one request.
+ * The inode's own list is written by sync_mapping_buffers(), which plugs
+ * as well and leaves the ordering to the block layer.
+ */
+
+#define HUST_META_BATCH 32
+
+struct HUST_meta_batch {
+	struct buffer_head *bhs[HUST_META_BATCH];
+	int nr;
+	int err;
+};
+
+static int HUST_meta_cmp(const void *a, const void *b)
+{
+	sector_t x = (*(struct buffer_head * const *)a)->b_blocknr;
+	sector_t y = (*(struct buffer_head * const *)b)->b_blocknr;
+
+	if (x == y)
+		return 0;
+	return x < y ? -1 : 1;
+}
+
+/* Write the dirty ones of @bhs in block order and wait for all of them. */
+int HUST_meta_write(struct buffer_head **bhs, int nr)
+{
+	struct blk_plug plug;
+	int i, err = 0;
+
+	sort(bhs, nr, sizeof(*bhs), HUST_meta_cmp, NULL);
+	blk_start_plug(&plug);
+	for (i = 0; i < nr; i++)
+		write_dirty_buffer(bhs[i], REQ_SYNC);
+	blk_finish_plug(&plug);
+	for (i = 0; i < nr; i++) {
+		wait_on_buffer(bhs[i]);
+		if (!err && !buffer_uptodate(bhs[i]))
+			err = -EIO;
+	}
+	return err;
+}
+
+static void HUST_meta_flush(struct HUST_meta_batch *batch)
+{
+	int i, err;
+
+	err = HUST_meta_write(batch->bhs, batch->nr);
+	if (!batch->err)
+		batch->err = err;
+	for (i = 0; i < batch->nr; i++)
+		brelse(batch->bhs[i]);
+	batch->nr = 0;
+}
+
+/* Queue @bh, whose reference the batch takes over. */
+static void HUST_meta_add(struct HUST_meta_batch *batch, struct buffer_head *bh)
+{
+	batch->bhs[batch->nr++] = bh;
+	if (batch->nr == HUST_META_BATCH)
+		HUST_meta_flush(batch);
+}
+
+/* Write the buffers associated with @inode and @extra, and wait for them. */
+int HUST_meta_sync_inode(struct inode *inode, struct buffer_head *extra)
+{
+	int err = 0, ret;
+
+	if (extra)
+		err = HUST_meta_write(&extra, 1);
+	ret = sync_mapping_buffers(&inode->i_data);
+	return err ? err : ret;
+}
+
+/*
+ * Block bitmap block @idx, counted from bmap_block, was changed for
+ * @inode.  Caller holds its alloc_mutex.
+ */
+void HUST_meta_note_bmap(struct inode *inode, uint64_t idx)
+{
+	struct HUST_inode_info *hi = HUST_I(inode);
+
+	hi->i_bmap_lo = min(hi->i_bmap_lo, idx);
+	hi->i_bmap_hi = max(hi->i_bmap_hi, idx);
+}
+
+/*
+ * fsync without a journal: write the pages, then in one sorted batch the
+ * inode's table block, the bitmap blocks its allocations changed, the
+ * inode bitmap block holding it and the superblock, then its directory
+ * or indirect blocks, and flush the disk cache once for all of it.
+ */
+int HUST_meta_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+	struct inode *inode = file->f_mapping->host;
+	struct super_block *sb = inode->i_sb;
+	struct HUST_fs_super_block *disk_sb = HUST_SB(sb)->s_disk;
+	struct HUST_inode_info *hi = HUST_I(inode);
+	struct HUST_meta_batch batch = { .nr = 0, .err = 0 };
+	struct HUST_inode raw_inode;
+	struct buffer_head *bh;
+	uint64_t lo, last, i;
+	int ret;
+
+	ret = file_write_and_wait_range(file, start, end);
+	if (ret)
+		return ret;
+
+	/* writing the pages back may have allocated; take it all along */
+	mutex_lock(&hi->alloc_mutex);
+	HUST_fs_fill_raw_inode(inode, &raw_inode);
+	lo = hi->i_bmap_lo;
+	last = hi->i_bmap_hi;
+	hi->i_bmap_lo = U64_MAX;
+	hi->i_bmap_hi = 0;
+	mutex_unlock(&hi->alloc_mutex);
+
+	bh = HUST_fs_update_inode(sb, &raw_inode);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	HUST_meta_add(&batch, bh);
+	for (i = lo; i <= last; i++) {
+		/* a bitmap block not in the cache has nothing to write */
+		bh = sb_find_get_block(sb, disk_sb->bmap_block + i);
+		if (bh)
+			HUST_meta_add(&batch, bh);
+	}
+	bh = sb_find_get_block(sb, disk_sb->imap_block +
+			       inode->i_ino / HUST_BITS_PER_BLOCK(sb));
+	if (bh)
+		HUST_meta_add(&batch, bh);
+	get_bh(HUST_SB(sb)->s_sbh);
+	HUST_meta_add(&batch, HUST_SB(sb)->s_sbh);
+	HUST_meta_flush(&batch);
+
+	ret = sync_mapping_buffers(&inode->i_data);
+	if (!ret)
+		ret = batch.err;
+	if (!ret)
+		ret = blkdev_issue_flush(sb->s_bdev, GFP_KERNEL, NULL);
+	return ret;
+}
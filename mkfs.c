@@ -1,20 +1,29 @@
 /*
- * HUST_fs disk layout:
- * 100MB disk -> 25600 blocks
- * And can write 25600 files at most.
- * inode size is 128B
- * block size is 4096B <=> 4K
- * block0 |dummy block
- * block1 |super block
- * block2 |bmap block
- * block3 |imap block
- * block4 - block(25600/(4096/64) + 3) |inode table
- * other blocks |data blocks
+ * HUST_fs disk layout, in blocks of -b bytes (4K by default, 1K to 64K):
+ * block0 ... |dummy; the super block is always at byte 4096, so it
+ *            |takes block 1 with 4K blocks (RESERVE_BLOCKS)
+ * gdt_block  |group descriptors, one per inode table group
+ * bmap_block |block bitmap, sized for -G max-blocks
+ * imap_block |inode bitmap, room for one inode per block of -G
+ * inode_table_block |inode table: one inode per -i bytes (16K) or -N;
+ *            |128B inodes (version 2, default) or 264B (-V 1)
+ * journal_block |jbd2 log, 1/64 of the disk or -J; none under 256MB
+ * data_block_number |data blocks
+ *
+ * A 100MB disk with the defaults has 25600 blocks and 6400 inodes in one
+ * group: gdt at block 2, bmap 3, imap 4, inode table 5 - 204, no journal
+ * and data from 205.  The kernel adds groups as inodes run out, up to
+ * 25600.
+ *
+ * Only the inode table slice of group 0 is written; the other groups are
+ * flagged uninitialized and zeroed by the kernel after mount (-z zeroes
+ * the whole table here instead).
  */
 
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -31,6 +40,14 @@ static uint64_t disk_size;
 static uint64_t bmap_size;
 static uint64_t imap_size;
 static uint64_t inode_table_size;
+static uint64_t fs_version = HUST_VERSION_2;
+static uint64_t gdt_size;
+static int lazy_itable_init = 1;
+static uint64_t bytes_per_inode = HUST_DEFAULT_INODE_RATIO;
+static uint64_t inodes_wanted;
+static int64_t journal_wanted = -1; //-1: size by disk
+static uint64_t max_blocks_wanted; //-G: online grow limit
+static uint64_t block_size = HUST_BLOCKSIZE; //-b
 
 struct HUST_fs_super_block {
 	uint64_t version;
@@ -44,10 +61,27 @@ struct HUST_fs_super_block {
 	uint64_t imap_block;
 	uint64_t inode_table_block;
 	uint64_t data_block_number;
-	char padding[4016];
+
+	uint64_t features;
+	uint64_t inodes_per_group;
+	uint64_t groups_count;
+	uint64_t gdt_block;
+	uint64_t max_inodes;
+	uint64_t journal_block;
+	uint64_t journal_blocks;
+	uint64_t state;
+	uint64_t free_inodes;
+	char padding[3944];
 };
 static struct HUST_fs_super_block super_block;
 
+struct HUST_group_desc {
+	uint64_t itable_block;
+	uint32_t itable_blocks;
+	uint32_t flags;
+};
+static struct HUST_group_desc *gdt;
+
 struct HUST_inode {
 	mode_t mode;//sizeof(mode_t) is 4
 	uint64_t inode_no;
@@ -64,11 +98,42 @@ struct HUST_inode {
     int64_t i_atime;
     int64_t i_mtime;
     int64_t i_ctime;
-    char padding[112];
+    uint32_t i_atime_nsec;
+    uint32_t i_mtime_nsec;
+    uint32_t i_ctime_nsec;
+    uint32_t i_flags;
+    char padding[96];
 };
 
 #define HUST_INODE_SIZE sizeof(struct HUST_inode)
 
+struct HUST_inode_v2 {
+	uint32_t mode;
+	uint32_t i_nlink;
+	uint32_t i_uid;
+	uint32_t i_gid;
+	uint64_t inode_no;
+	union {
+		uint64_t file_size;
+		uint64_t dir_children_count;
+	};
+	uint32_t blocks;
+	uint32_t i_flags;
+	uint32_t block[HUST_N_BLOCKS];
+	int64_t i_atime;
+	int64_t i_mtime;
+	int64_t i_ctime;
+	uint32_t i_atime_nsec;
+	uint32_t i_mtime_nsec;
+	uint32_t i_ctime_nsec;
+	uint32_t i_reserved[3];
+} __attribute__((packed));
+
+static uint64_t inode_size(void)
+{
+	return fs_version >= HUST_VERSION_2 ? HUST_INODE_V2_SIZE : HUST_INODE_SIZE;
+}
+
 
 struct HUST_dir_record
 {
@@ -76,6 +141,29 @@ struct HUST_dir_record
 	uint64_t inode_no;
 };
 
+struct HUST_dir_entry {
+	uint64_t inode_no;
+	uint16_t rec_len;
+	uint8_t name_len;
+	uint8_t file_type;
+	char name[];
+} __attribute__((packed));
+
+#define HUST_DIR_REC_LEN(name_len) (((name_len) + sizeof(struct HUST_dir_entry) + 7) & ~7)
+
+//append a record at *off of block buf; last stretches it to the block end
+static void add_dirent(char *buf, uint64_t *off, const char *name,
+		       uint64_t inode_no, uint8_t file_type, int last)
+{
+	struct HUST_dir_entry *e = (struct HUST_dir_entry *)(buf + *off);
+	e->inode_no = inode_no;
+	e->file_type = file_type;
+	e->name_len = strlen(name);
+	e->rec_len = last ? block_size - *off : HUST_DIR_REC_LEN(e->name_len);
+	memcpy(e->name, name, e->name_len);
+	*off += e->rec_len;
+}
+
 static off_t get_file_size(const char* path)
 {
 	off_t ret = -1;
@@ -92,7 +180,7 @@ static int set_bmap(uint64_t idx, int value)
 	}
 	uint64_t array_idx = idx/(sizeof(char)*8);
 	uint64_t off = idx%(sizeof(char)*8);
-	if(array_idx > bmap_size*HUST_BLOCKSIZE) {
+	if(array_idx > bmap_size*block_size) {
 		printf("Set bmap error and idx is %llu\n", idx);
 		return -1;
 	}
@@ -110,38 +198,119 @@ static int init_disk(int fd, const char* path)
 		return -1;
 	}
 	printf("Disk size id %lu\n", disk_size);
-	super_block.version = 1;
-	super_block.block_size = HUST_BLOCKSIZE;
+	super_block.version = fs_version;
+	super_block.block_size = block_size;
 	super_block.magic = MAGIC_NUM;
-	super_block.blocks_count = disk_size/HUST_BLOCKSIZE;
+	super_block.blocks_count = disk_size/block_size;
 	printf("blocks count is %llu\n", super_block.blocks_count);
-	super_block.inodes_count = super_block.blocks_count;
+	//-N wins over -i; the root dir and "file" need two inodes
+	super_block.inodes_count = inodes_wanted ? inodes_wanted : disk_size/bytes_per_inode;
+	if (super_block.inodes_count < 2)
+		super_block.inodes_count = 2;
 	super_block.free_blocks = 0;
+
+	//计算group
+	uint64_t inodes_per_block = block_size/inode_size();
+	if (fs_version >= HUST_VERSION_2 && super_block.blocks_count > UINT32_MAX) {
+		printf("Version 2 supports at most %u blocks\n", UINT32_MAX);
+		return -1;
+	}
+	super_block.features = HUST_FEATURE_GROUPS | HUST_FEATURE_DIR_INDEX |
+		HUST_FEATURE_INDIRECT | HUST_FEATURE_VARDIR;
+	//one imap block worth of inodes per group
+	super_block.inodes_per_group = (8*block_size/inodes_per_block)*inodes_per_block;
+	uint64_t rounded = (super_block.inodes_count + inodes_per_block - 1)
+		/ inodes_per_block * inodes_per_block;
+	if (super_block.inodes_per_group > rounded)
+		super_block.inodes_per_group = rounded;
+	super_block.groups_count = (super_block.inodes_count + super_block.inodes_per_group - 1)
+		/ super_block.inodes_per_group;
+	//whole groups only, so the kernel can append more of them
+	super_block.inodes_count = super_block.groups_count*super_block.inodes_per_group;
+	inode_table_size = super_block.inodes_count/inodes_per_block;
+	//bitmaps and gdt are sized for growing online up to max_blocks
+	uint64_t max_blocks = super_block.blocks_count;
+	if (max_blocks_wanted > max_blocks)
+		max_blocks = max_blocks_wanted;
+	if (fs_version >= HUST_VERSION_2 && max_blocks > UINT32_MAX)
+		max_blocks = UINT32_MAX;
+	//leave imap and gdt room to grow up to one inode per block
+	uint64_t max_groups = (max_blocks + super_block.inodes_per_group - 1)
+		/ super_block.inodes_per_group;
+	if (max_groups < super_block.groups_count)
+		max_groups = super_block.groups_count;
+	super_block.max_inodes = max_groups*super_block.inodes_per_group;
+	printf("inodes count is %" PRIu64 ", growing up to %" PRIu64 "\n",
+			super_block.inodes_count, super_block.max_inodes);
+	gdt_size = (max_groups*sizeof(struct HUST_group_desc) + block_size - 1)
+		/ block_size;
+	super_block.gdt_block = RESERVE_BLOCKS(block_size);
+	gdt = (struct HUST_group_desc *)calloc(gdt_size, block_size);
+	if (!gdt) {
+		perror("Error: can not allocate group descriptors!\n");
+		return -1;
+	}
 	//计算bmap
-	bmap_size = super_block.blocks_count/(8*HUST_BLOCKSIZE);
-	super_block.bmap_block = RESERVE_BLOCKS;
+	bmap_size = max_blocks/(8*block_size);
+	super_block.bmap_block = RESERVE_BLOCKS(block_size) + gdt_size;
 
-	if (super_block.blocks_count%(8*HUST_BLOCKSIZE) != 0) {
+	if (max_blocks%(8*block_size) != 0) {
 		bmap_size += 1;
 	}
-	bmap = (uint8_t *)malloc(bmap_size*HUST_BLOCKSIZE);
-	memset(bmap,0,bmap_size*HUST_BLOCKSIZE);
+	bmap = (uint8_t *)malloc(bmap_size*block_size);
+	memset(bmap,0,bmap_size*block_size);
 
 	//计算imap
-	imap_size = super_block.inodes_count/(8*HUST_BLOCKSIZE);
+	imap_size = super_block.max_inodes/(8*block_size);
 	super_block.imap_block = super_block.bmap_block + bmap_size;
 
-	if(super_block.inodes_count%(8*HUST_BLOCKSIZE) != 0) {
+	if(super_block.max_inodes%(8*block_size) != 0) {
 		imap_size += 1;
 	}
-	imap = (uint8_t *)malloc(imap_size*HUST_BLOCKSIZE);
-	memset(imap,0,imap_size*HUST_BLOCKSIZE);
+	imap = (uint8_t *)malloc(imap_size*block_size);
+	memset(imap,0,imap_size*block_size);
 
 	//计算inode_table
-	inode_table_size = super_block.inodes_count/(HUST_BLOCKSIZE/HUST_INODE_SIZE);
 	super_block.inode_table_block = super_block.imap_block + imap_size;
-	super_block.data_block_number = RESERVE_BLOCKS + bmap_size + imap_size + inode_table_size;
+	super_block.data_block_number = super_block.inode_table_block + inode_table_size;
+
+	//journal: 1/64 of the disk by default, none if that is below the jbd2 minimum
+	uint64_t journal_blocks = journal_wanted;
+	if (journal_wanted < 0) {
+		journal_blocks = super_block.blocks_count/64;
+		if (journal_blocks < HUST_JOURNAL_MIN_BLOCKS)
+			journal_blocks = 0;
+		if (journal_blocks > HUST_JOURNAL_MAX_BLOCKS)
+			journal_blocks = HUST_JOURNAL_MAX_BLOCKS;
+	}
+	if (journal_blocks &&
+	    super_block.data_block_number + journal_blocks >= super_block.blocks_count) {
+		printf("No room for a journal of %" PRIu64 " blocks\n", journal_blocks);
+		return -1;
+	}
+	if (journal_blocks) {
+		super_block.features |= HUST_FEATURE_JOURNAL;
+		super_block.journal_block = super_block.data_block_number;
+		super_block.journal_blocks = journal_blocks;
+		super_block.data_block_number += journal_blocks;
+		printf("journal of %" PRIu64 " blocks at block %" PRIu64 "\n",
+				journal_blocks, super_block.journal_block);
+	}
+
+	uint64_t group;
+	uint64_t itable_per_group = super_block.inodes_per_group/inodes_per_block;
+	for (group = 0; group < super_block.groups_count; ++group) {
+		uint64_t start = group*itable_per_group;
+		gdt[group].itable_block = super_block.inode_table_block + start;
+		gdt[group].itable_blocks = inode_table_size - start < itable_per_group ?
+			inode_table_size - start : itable_per_group;
+		if (group && lazy_itable_init)
+			gdt[group].flags = HUST_BG_ITABLE_UNINIT;
+	}
 	super_block.free_blocks = super_block.blocks_count - super_block.data_block_number - 1;
+	//the root dir and "file"
+	super_block.free_inodes = super_block.inodes_count - 2;
+	super_block.state = HUST_STATE_CLEAN;
 
 	//设置bmap以及imap
 	int idx;
@@ -155,24 +324,54 @@ static int init_disk(int fd, const char* path)
 	
 	return 0;
 }
+static int write_zero(int fd, uint64_t size);
+
 static int write_sb(int fd) 
 {
 	ssize_t ret;
 	ret = write(fd, &super_block, sizeof(super_block));
-	if(ret != HUST_BLOCKSIZE) {
+	if(ret != sizeof(super_block)) {
 		perror("Write super block error!\n");
 		return -1;
 	}
+	//with blocks over 8K the rest of block 0 is padding
+	if (write_zero(fd, RESERVE_BLOCKS(block_size)*block_size - 2*HUST_SB_OFFSET))
+		return -1;
 	printf("Super block written succesfully!\n");
 	return 0;
 }
 
+static int write_gdt(int fd)
+{
+	ssize_t ret;
+	ret = write(fd, gdt, gdt_size*block_size);
+	if (ret != gdt_size*block_size) {
+		perror("write_gdt() error!\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int write_zero(int fd, uint64_t size)
+{
+	static const char zero[4096];
+	while (size) {
+		size_t len = size < sizeof(zero) ? size : sizeof(zero);
+		if (write(fd, zero, len) != len) {
+			perror("write_zero() error!\n");
+			return -1;
+		}
+		size -= len;
+	}
+	return 0;
+}
+
 static int write_bmap(int fd) 
 {
 	ssize_t ret = -1;
 
-	ret = write(fd, bmap, bmap_size*HUST_BLOCKSIZE);
-	if (ret != bmap_size*HUST_BLOCKSIZE) {
+	ret = write(fd, bmap, bmap_size*block_size);
+	if (ret != bmap_size*block_size) {
 		perror("Write_bmap() error!\n");
 		return -1;
 	}
@@ -181,17 +380,48 @@ static int write_bmap(int fd)
 }
 static int write_imap(int fd)
 {
-	memset(imap, 0, imap_size*HUST_BLOCKSIZE);
+	memset(imap, 0, imap_size*block_size);
 	imap[0] |= 0x3;
 
-	ssize_t res = write(fd, imap, imap_size*HUST_BLOCKSIZE);
-	if (res != imap_size*HUST_BLOCKSIZE) {
+	ssize_t res = write(fd, imap, imap_size*block_size);
+	if (res != imap_size*block_size) {
 		perror("write_imap() erroe!");
 		return -1;
 	}
 	return 0;
 }
 
+static int write_inode(int fd, const struct HUST_inode *inode)
+{
+	struct HUST_inode_v2 disk;
+	const void *buf = inode;
+	size_t size = sizeof(*inode);
+	int i;
+
+	if (fs_version >= HUST_VERSION_2) {
+		memset(&disk, 0, sizeof(disk));
+		disk.mode = inode->mode;
+		disk.i_nlink = inode->i_nlink;
+		disk.i_uid = inode->i_uid;
+		disk.i_gid = inode->i_gid;
+		disk.inode_no = inode->inode_no;
+		disk.file_size = inode->file_size;
+		disk.blocks = inode->blocks;
+		for (i = 0; i < HUST_N_BLOCKS; i++)
+			disk.block[i] = inode->block[i];
+		disk.i_atime = inode->i_atime;
+		disk.i_mtime = inode->i_mtime;
+		disk.i_ctime = inode->i_ctime;
+		buf = &disk;
+		size = sizeof(disk);
+	}
+	if (write(fd, buf, size) != size) {
+		perror("write_itable error!\n");
+		return -1;
+	}
+	return 0;
+}
+
 static int write_itable(int fd)
 {
     uint32_t _uid = getuid();
@@ -199,6 +429,7 @@ static int write_itable(int fd)
     
 	ssize_t ret;
 	struct HUST_inode root_dir_inode;
+	memset(&root_dir_inode, 0, sizeof(root_dir_inode));
 	root_dir_inode.mode = S_IFDIR;
 	root_dir_inode.inode_no = HUST_ROOT_INODE_NUM;
 	root_dir_inode.blocks = 1;
@@ -209,12 +440,10 @@ static int write_itable(int fd)
     root_dir_inode.i_nlink = 2; 
     root_dir_inode.i_atime = root_dir_inode.i_mtime = root_dir_inode.i_ctime = ((int64_t)time(NULL));
     
-	ret = write(fd, &root_dir_inode, sizeof(root_dir_inode));
-	if (ret != sizeof(root_dir_inode)) {
-		perror("write_itable error!\n");
+	if (write_inode(fd, &root_dir_inode))
 		return -1;
-	}
 	struct HUST_inode onefile_inode;
+	memset(&onefile_inode, 0, sizeof(onefile_inode));
 	onefile_inode.mode = S_IFREG;
 	onefile_inode.inode_no = 1;
 	onefile_inode.blocks = 0;
@@ -225,51 +454,88 @@ static int write_itable(int fd)
     onefile_inode.i_nlink = 1; 
     onefile_inode.i_atime = onefile_inode.i_mtime = onefile_inode.i_ctime = ((int64_t)time(NULL));
 
-	ret = write(fd, &onefile_inode, sizeof(onefile_inode));
-	if (ret != sizeof(onefile_inode)) {
-		perror("write_itable error!\n");
+	if (write_inode(fd, &onefile_inode))
 		return -1;
-	}
 
-	struct HUST_dir_record root_dir_c;
-	const char* cur_dir = ".";
-	const char* parent_dir = "..";
-	
-	
-	memcpy(root_dir_c.filename, cur_dir, strlen(cur_dir) + 1);
-	root_dir_c.inode_no = HUST_ROOT_INODE_NUM;
-	struct HUST_dir_record root_dir_p;
-	memcpy(root_dir_p.filename, parent_dir, strlen(parent_dir) + 1);
-	root_dir_p.inode_no = HUST_ROOT_INODE_NUM;
+	//zero the rest of group 0, or of the whole table without lazy init
+	uint64_t itable_written = lazy_itable_init ? gdt[0].itable_blocks : inode_table_size;
+	if (write_zero(fd, itable_written*block_size - 2*inode_size()))
+		return -1;
 
-	struct HUST_dir_record file_record;
-	const char* onefile = "file";
-	memcpy(file_record.filename, onefile, strlen(onefile) + 1);
-	file_record.inode_no = 1;
+	static char root_block[HUST_MAX_BLOCKSIZE];
+	uint64_t off = 0;
+	add_dirent(root_block, &off, ".", HUST_ROOT_INODE_NUM, HUST_FT_DIR, 0);
+	add_dirent(root_block, &off, "..", HUST_ROOT_INODE_NUM, HUST_FT_DIR, 0);
+	add_dirent(root_block, &off, "file", 1, HUST_FT_REG_FILE, 1);
 
 	off_t current_off = lseek(fd, 0L, SEEK_CUR);
 	printf("Current seek is %lu and rootdir at %lu\n", current_off
-			, super_block.data_block_number*HUST_BLOCKSIZE);
+			, super_block.data_block_number*block_size);
 
-	if(-1 == lseek(fd, super_block.data_block_number*HUST_BLOCKSIZE, SEEK_SET)) {
+	if(-1 == lseek(fd, super_block.data_block_number*block_size, SEEK_SET)) {
 		perror("lseek error\n");
 		return -1;
 	}
-	ret = write(fd, &root_dir_c, sizeof(root_dir_c));
-	ret = write(fd, &root_dir_p, sizeof(root_dir_p));
-	ret = write(fd, &file_record, sizeof(file_record));
-	if (ret != sizeof(root_dir_c)) {
+	ret = write(fd, root_block, block_size);
+	if (ret != block_size) {
 		perror("Write error!\n");
 		return -1;
 	}
 	printf("Create root dir successfully!\n");
 	return 0;
 }
+//an empty jbd2 v2 superblock, all fields big-endian; the kernel does the rest
+struct journal_superblock {
+	uint32_t h_magic;
+	uint32_t h_blocktype;
+	uint32_t h_sequence;
+	uint32_t s_blocksize;
+	uint32_t s_maxlen;
+	uint32_t s_first;
+	uint32_t s_sequence;
+	uint32_t s_start; //0: nothing to replay
+	uint32_t s_errno;
+	uint32_t s_feature_compat;
+	uint32_t s_feature_incompat;
+	uint32_t s_feature_ro_compat;
+	uint8_t s_uuid[16];
+	uint32_t s_nr_users;
+};
+
+#define JBD2_MAGIC_NUMBER 0xc03b3998U
+#define JBD2_SUPERBLOCK_V2 4
+
+static int write_journal(int fd)
+{
+	static char block[HUST_MAX_BLOCKSIZE];
+	struct journal_superblock *jsb = (struct journal_superblock *)block;
+
+	if (!(super_block.features & HUST_FEATURE_JOURNAL))
+		return 0;
+	jsb->h_magic = htobe32(JBD2_MAGIC_NUMBER);
+	jsb->h_blocktype = htobe32(JBD2_SUPERBLOCK_V2);
+	jsb->s_blocksize = htobe32(block_size);
+	jsb->s_maxlen = htobe32(super_block.journal_blocks);
+	jsb->s_first = htobe32(1);
+	jsb->s_sequence = htobe32(1);
+	jsb->s_nr_users = htobe32(1);
+
+	if (-1 == lseek(fd, super_block.journal_block*block_size, SEEK_SET)) {
+		perror("lseek error\n");
+		return -1;
+	}
+	if (write(fd, block, block_size) != block_size) {
+		perror("write_journal() error!\n");
+		return -1;
+	}
+	return 0;
+}
+
 static int write_dummy(int fd)
 {
-	char dummy[HUST_BLOCKSIZE] = {0};
-	ssize_t res = write(fd, dummy, HUST_BLOCKSIZE);
-	if (res != HUST_BLOCKSIZE) {
+	char dummy[HUST_SB_OFFSET] = {0};
+	ssize_t res = write(fd, dummy, HUST_SB_OFFSET);
+	if (res != HUST_SB_OFFSET) {
 		perror("write_dummy error!");
 		return -1;
 	}
@@ -279,14 +545,67 @@ static int write_dummy(int fd)
 int main(int argc, char *argv[])
 {
 	int fd;
+	int opt;
 	ssize_t ret;
+	const char *usage = "Usage: mkfs [-V 1|2] [-z] [-i bytes-per-inode] [-N inodes] [-J journal-blocks] [-G max-blocks] [-b block-size] <device>\n";
 
-	if(argc != 2) {
-		printf("Usage: mkfs <device>\n");
+	while ((opt = getopt(argc, argv, "V:zi:N:J:G:b:")) != -1) {
+		switch (opt) {
+		case 'b':
+			block_size = strtoull(optarg, NULL, 10);
+			if (block_size < HUST_MIN_BLOCKSIZE ||
+			    block_size > HUST_MAX_BLOCKSIZE ||
+			    (block_size & (block_size - 1))) {
+				printf("Block size must be a power of two from %d to %d\n",
+						HUST_MIN_BLOCKSIZE, HUST_MAX_BLOCKSIZE);
+				return -1;
+			}
+			break;
+		case 'G':
+			max_blocks_wanted = strtoull(optarg, NULL, 10);
+			break;
+		case 'J':
+			journal_wanted = strtoll(optarg, NULL, 10);
+			if (journal_wanted != 0 &&
+			    (journal_wanted < HUST_JOURNAL_MIN_BLOCKS ||
+			     journal_wanted > INT32_MAX)) {
+				printf("Journal must be 0 or %d to %d blocks\n",
+						HUST_JOURNAL_MIN_BLOCKS, INT32_MAX);
+				return -1;
+			}
+			break;
+		case 'i':
+			bytes_per_inode = strtoull(optarg, NULL, 10);
+			if (bytes_per_inode < HUST_INODE_V2_SIZE) {
+				printf("Bad bytes-per-inode %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'N':
+			inodes_wanted = strtoull(optarg, NULL, 10);
+			break;
+		case 'z':
+			lazy_itable_init = 0;
+			break;
+		case 'V':
+			fs_version = strtoull(optarg, NULL, 10);
+			if (fs_version != HUST_VERSION_1 &&
+			    fs_version != HUST_VERSION_2) {
+				printf("Unsupported version %s\n", optarg);
+				return -1;
+			}
+			break;
+		default:
+			printf("%s", usage);
+			return -1;
+		}
+	}
+	if(optind != argc - 1) {
+		printf("%s", usage);
 		return -1;
 	}
 
-	fd = open(argv[1]
+	fd = open(argv[optind]
 			, O_RDWR);
 	if (fd == -1) {
 		perror("Error opening the device");
@@ -294,12 +613,15 @@ int main(int argc, char *argv[])
 	}
 	ret = 1;
 
-	init_disk(fd, argv[1]);
+	if (init_disk(fd, argv[optind]))
+		return -1;
 	write_dummy(fd);
 	write_sb(fd);
+	write_gdt(fd);
 	write_bmap(fd);
 	write_imap(fd);
 	write_itable(fd);
+	write_journal(fd);
 //	write_root_dir(fd);
 //	write_welcome_file(fd);
 
@@ -0,0 +1,166 @@
+#include "constants.h"
+#include "HUST_fs.h"
+#include <linux/blkdev.h>
+
+/*
+ * Online grow.
+ *
+ * The block bitmap runs from bmap_block to imap_block, so a file system
+ * can cover as many blocks as those bitmap blocks have bits; mkfs -G
+ * sizes them, and the group descriptor table and imap, for a larger
+ * disk than the one being formatted.  Growing clears the bits of the new
+ * blocks and raises blocks_count and free_blocks in one transaction,
+ * split into several when the bitmap blocks touched would not fit in
+ * one.  The inode table needs nothing here: once the inodes run out it
+ * grows by whole groups into free data blocks, the new ones included.
+ *
+ * Each step holds s_bmap_mutex, under which allocators read
+ * blocks_count and the bitmap, so none sees the one without the other.
+ */
+
+/* Most blocks the bitmap of this file system can describe. */
+static uint64_t HUST_fs_bmap_capacity(struct super_block *sb)
+{
+	struct HUST_fs_super_block *disk_sb = HUST_SB(sb)->s_disk;
+
+	return (disk_sb->imap_block - disk_sb->bmap_block) *
+	    HUST_BITS_PER_BLOCK(sb);
+}
+
+/*
+ * Mark blocks @from to @to free; mkfs left them clear, but be sure.
+ * The caller has a handle for each bitmap block and holds s_bmap_mutex.
+ */
+static int HUST_fs_clear_bmap_range(struct super_block *sb, uint64_t from,
+				    uint64_t to)
+{
+	struct HUST_fs_super_block *disk_sb = HUST_SB(sb)->s_disk;
+	uint64_t bits = HUST_BITS_PER_BLOCK(sb);
+	int err = 0;
+
+	while (from < to && !err) {
+		uint64_t end = min(to, round_down(from, bits) + bits);
+		uint64_t i = from % bits, last = i + (end - from);
+		struct buffer_head *bh;
+
+		bh = HUST_sb_bread(sb, disk_sb->bmap_block + from / bits);
+		if (!bh)
+			return -EIO;
+		if (find_next_bit_le(bh->b_data, last, i) < last) {
+			err = HUST_journal_get_write_access(sb, bh);
+			if (!err) {
+				lock_buffer(bh);
+				for (; i < last; i++)
+					clearbit(bh->b_data[i/8], i%8);
+				unlock_buffer(bh);
+				err = HUST_journal_dirty_metadata(sb, bh);
+			}
+		}
+		brelse(bh);
+		from = end;
+	}
+	return err;
+}
+
+/* Most blocks one step may add: a credit per bitmap block touched. */
+static uint64_t HUST_fs_grow_limit(struct super_block *sb)
+{
+	uint64_t bits = HUST_BITS_PER_BLOCK(sb);
+	uint64_t nr = HUST_journal_max_alloc(sb);
+
+	/* the range may start and end inside a bitmap block */
+	if (nr <= 2)
+		return bits;
+	return min(nr - 2, HUST_fs_bmap_capacity(sb) / bits) * bits;
+}
+
+/*
+ * Grow from blocks_count to @to in one transaction.  Caller holds
+ * s_grow_mutex.
+ */
+static int HUST_fs_grow_step(struct super_block *sb, uint64_t to)
+{
+	struct HUST_sb_info *sbi = HUST_SB(sb);
+	struct HUST_fs_super_block *disk_sb = sbi->s_disk;
+	uint64_t bits = HUST_BITS_PER_BLOCK(sb);
+	uint64_t from = disk_sb->blocks_count;
+	handle_t *handle;
+	int ret;
+
+	/* the bitmap blocks of [from, to) and the superblock */
+	handle = HUST_journal_start(sb, DIV_ROUND_UP(to, bits) - from / bits + 1);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	mutex_lock(&sbi->s_bmap_mutex);
+	ret = HUST_fs_clear_bmap_range(sb, from, to);
+	if (!ret)
+		ret = HUST_journal_get_write_access(sb, sbi->s_sbh);
+	if (!ret) {
+		percpu_counter_add(&sbi->s_freeblocks_counter, to - from);
+		lock_buffer(sbi->s_sbh);
+		WRITE_ONCE(disk_sb->blocks_count, to);
+		disk_sb->free_blocks =
+		    percpu_counter_sum_positive(&sbi->s_freeblocks_counter);
+		unlock_buffer(sbi->s_sbh);
+		ret = save_super(sb);
+	}
+	mutex_unlock(&sbi->s_bmap_mutex);
+	HUST_journal_stop(handle);
+	return ret;
+}
+
+/*
+ * Grow to *@blocks, rounded down to HUST_GROW_ALIGN so the bitmap ends on
+ * a whole word, and store the count used in *@blocks.
+ */
+int HUST_fs_resize(struct super_block *sb, uint64_t *blocks)
+{
+	struct HUST_sb_info *sbi = HUST_SB(sb);
+	struct HUST_fs_super_block *disk_sb = sbi->s_disk;
+	uint64_t old_count, new_count, dev_blocks, limit, step;
+	int ret;
+
+	dev_blocks = i_size_read(sb->s_bdev->bd_inode) >> sb->s_blocksize_bits;
+	limit = HUST_fs_bmap_capacity(sb);
+	/* version 2 inodes hold 32-bit block numbers */
+	if (disk_sb->version >= HUST_VERSION_2)
+		limit = min_t(uint64_t, limit, U32_MAX);
+
+	mutex_lock(&sbi->s_grow_mutex);
+	old_count = disk_sb->blocks_count;
+	if (*blocks <= old_count) {
+		/* shrinking would have to move data */
+		ret = *blocks == old_count ? 0 : -EINVAL;
+		goto out;
+	}
+	new_count = round_down(*blocks, HUST_GROW_ALIGN);
+	if (new_count <= old_count) {
+		/* not up to the next multiple, nothing to add */
+		*blocks = old_count;
+		ret = 0;
+		goto out;
+	}
+	if (new_count > dev_blocks) {
+		ret = -EINVAL;
+		goto out;
+	}
+	if (new_count > limit) {
+		printk(KERN_ERR "HUST_fs: cannot grow past %llu blocks\n", limit);
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	step = HUST_fs_grow_limit(sb);
+	do {
+		ret = HUST_fs_grow_step(sb, min(new_count,
+						disk_sb->blocks_count + step));
+	} while (!ret && disk_sb->blocks_count < new_count);
+	if (!ret) {
+		printk(KERN_INFO "HUST_fs: grown from %llu to %llu blocks\n",
+		       old_count, new_count);
+		*blocks = new_count;
+	}
+ out:
+	mutex_unlock(&sbi->s_grow_mutex);
+	return ret;
+}
@@ -0,0 +1,183 @@
+#include "constants.h"
+#include "HUST_fs.h"
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/timekeeping.h>
+
+/*
+ * Per-mount statistics in /sys/fs/HUST_fs/<dev>/.
+ *
+ * Every counter is a per-CPU u64 bumped with this_cpu_inc(), so the hot
+ * paths share no cache line and take no lock; reading a file sums the
+ * CPUs.  The sums are not a snapshot, counters keep moving while they
+ * are added up.  A *_latency file is a log2 histogram: one line
+ * "<ns> <count>" for each non-empty bucket, counting the calls that took
+ * from <ns> up to twice that, the last bucket everything longer.
+ */
+
+static struct kset *HUST_kset;
+
+struct HUST_stat_attr {
+	struct attribute attr;
+	bool hist;		/* index is a HUST_LAT_*, not a HUST_STAT_* */
+	int index;
+};
+
+#define HUST_STAT_ATTR(_name, _hist, _index)				\
+static struct HUST_stat_attr HUST_stat_attr_##_name = {			\
+	.attr = { .name = #_name, .mode = 0444 },			\
+	.hist = _hist,							\
+	.index = _index,						\
+}
+#define HUST_COUNTER(_name, _item) HUST_STAT_ATTR(_name, false, _item)
+#define HUST_HISTOGRAM(_name, _which) HUST_STAT_ATTR(_name, true, _which)
+
+HUST_COUNTER(buffer_reads, HUST_STAT_BUFFER_READS);
+HUST_COUNTER(bitmap_scans, HUST_STAT_BITMAP_SCANS);
+HUST_COUNTER(bits_scanned, HUST_STAT_BITS_SCANNED);
+HUST_COUNTER(alloc_ok, HUST_STAT_ALLOC_OK);
+HUST_COUNTER(alloc_fail, HUST_STAT_ALLOC_FAIL);
+HUST_COUNTER(lookup_hit, HUST_STAT_LOOKUP_HIT);
+HUST_COUNTER(lookup_miss, HUST_STAT_LOOKUP_MISS);
+HUST_COUNTER(dir_searches, HUST_STAT_DIR_SEARCHES);
+HUST_COUNTER(dirents_scanned, HUST_STAT_DIRENTS_SCANNED);
+HUST_COUNTER(itable_reads, HUST_STAT_ITABLE_READS);
+HUST_HISTOGRAM(get_block_latency, HUST_LAT_GET_BLOCK);
+HUST_HISTOGRAM(lookup_latency, HUST_LAT_LOOKUP);
+HUST_HISTOGRAM(create_latency, HUST_LAT_CREATE);
+
+#define ATTR_LIST(_name) (&HUST_stat_attr_##_name.attr)
+static struct attribute *HUST_stat_attrs[] = {
+	ATTR_LIST(buffer_reads),
+	ATTR_LIST(bitmap_scans),
+	ATTR_LIST(bits_scanned),
+	ATTR_LIST(alloc_ok),
+	ATTR_LIST(alloc_fail),
+	ATTR_LIST(lookup_hit),
+	ATTR_LIST(lookup_miss),
+	ATTR_LIST(dir_searches),
+	ATTR_LIST(dirents_scanned),
+	ATTR_LIST(itable_reads),
+	ATTR_LIST(get_block_latency),
+	ATTR_LIST(lookup_latency),
+	ATTR_LIST(create_latency),
+	NULL,
+};
+
+static ssize_t HUST_stat_show_hist(struct HUST_sb_info *sbi, int which,
+				   char *buf)
+{
+	u64 sum[HUST_LAT_BUCKETS] = { 0 };
+	ssize_t len = 0;
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		struct HUST_stats *s = per_cpu_ptr(sbi->s_stats, cpu);
+
+		for (i = 0; i < HUST_LAT_BUCKETS; i++)
+			sum[i] += s->lat[which][i];
+	}
+	/* bucket i holds fls64(ns) == i, that is [2^(i-1), 2^i) */
+	for (i = 0; i < HUST_LAT_BUCKETS; i++) {
+		if (!sum[i])
+			continue;
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%llu %llu\n",
+				 i ? 1ULL << (i - 1) : 0ULL, sum[i]);
+	}
+	return len;
+}
+
+static ssize_t HUST_stat_show(struct kobject *kobj, struct attribute *attr,
+			      char *buf)
+{
+	struct HUST_sb_info *sbi = container_of(kobj, struct HUST_sb_info,
+						s_kobj);
+	struct HUST_stat_attr *a = container_of(attr, struct HUST_stat_attr,
+						attr);
+	u64 sum = 0;
+	int cpu;
+
+	if (a->hist)
+		return HUST_stat_show_hist(sbi, a->index, buf);
+	for_each_possible_cpu(cpu)
+		sum += per_cpu_ptr(sbi->s_stats, cpu)->count[a->index];
+	return snprintf(buf, PAGE_SIZE, "%llu\n", sum);
+}
+
+static const struct sysfs_ops HUST_stat_ops = {
+	.show = HUST_stat_show,
+};
+
+static void HUST_sb_release(struct kobject *kobj)
+{
+	struct HUST_sb_info *sbi = container_of(kobj, struct HUST_sb_info,
+						s_kobj);
+
+	complete(&sbi->s_kobj_unregister);
+}
+
+static struct kobj_type HUST_sb_ktype = {
+	.default_attrs = HUST_stat_attrs,
+	.sysfs_ops = &HUST_stat_ops,
+	.release = HUST_sb_release,
+};
+
+/* Record the time since @start, from ktime_get_ns(), in histogram @which. */
+void HUST_stat_latency(struct super_block *sb, int which, u64 start)
+{
+	unsigned int bucket = fls64(ktime_get_ns() - start);
+
+	if (bucket >= HUST_LAT_BUCKETS)
+		bucket = HUST_LAT_BUCKETS - 1;
+	this_cpu_inc(HUST_SB(sb)->s_stats->lat[which][bucket]);
+}
+
+/* First thing at mount: everything after may count. */
+int HUST_stats_setup(struct super_block *sb)
+{
+	HUST_SB(sb)->s_stats = alloc_percpu(struct HUST_stats);
+	return HUST_SB(sb)->s_stats ? 0 : -ENOMEM;
+}
+
+/* Add /sys/fs/HUST_fs/<dev>, undone by HUST_stats_release(). */
+int HUST_stats_register(struct super_block *sb)
+{
+	struct HUST_sb_info *sbi = HUST_SB(sb);
+	int err;
+
+	init_completion(&sbi->s_kobj_unregister);
+	sbi->s_kobj.kset = HUST_kset;
+	err = kobject_init_and_add(&sbi->s_kobj, &HUST_sb_ktype, NULL, "%s",
+				   sb->s_id);
+	if (err) {
+		kobject_put(&sbi->s_kobj);
+		wait_for_completion(&sbi->s_kobj_unregister);
+		memset(&sbi->s_kobj, 0, sizeof(sbi->s_kobj));
+	}
+	return err;
+}
+
+/* Remove the directory, waiting out readers, and free the counters. */
+void HUST_stats_release(struct super_block *sb)
+{
+	struct HUST_sb_info *sbi = HUST_SB(sb);
+
+	if (sbi->s_kobj.state_initialized) {
+		kobject_del(&sbi->s_kobj);
+		kobject_put(&sbi->s_kobj);
+		wait_for_completion(&sbi->s_kobj_unregister);
+	}
+	free_percpu(sbi->s_stats);
+	sbi->s_stats = NULL;
+}
+
+int HUST_stats_init(void)
+{
+	HUST_kset = kset_create_and_add("HUST_fs", NULL, fs_kobj);
+	return HUST_kset ? 0 : -ENOMEM;
+}
+
+void HUST_stats_exit(void)
+{
+	kset_unregister(HUST_kset);
+}
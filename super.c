@@ -1,5 +1,13 @@
 #include "HUST_fs.h"
 #include "constants.h"
+#include <linux/statfs.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
+#include <linux/blkdev.h>
+#include <linux/log2.h>
+
+#define CREATE_TRACE_POINTS
+#include "HUST_trace.h"
 
 
 struct file_system_type HUST_fs_type = {
@@ -13,14 +21,28 @@ const struct file_operations HUST_fs_file_ops = {
 	.owner = THIS_MODULE,
 	.llseek = generic_file_llseek,
 	.mmap = generic_file_mmap,
-	.fsync = generic_file_fsync,
+	.fsync = HUST_fs_fsync,
 	.read_iter = generic_file_read_iter,
 	.write_iter = generic_file_write_iter,
+	.splice_read = generic_file_splice_read,
+	.splice_write = iter_file_splice_write,
+	.copy_file_range = HUST_fs_copy_file_range,
+	.unlocked_ioctl = HUST_fs_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl = HUST_fs_compat_ioctl,
+#endif
 };
 
 const struct file_operations HUST_fs_dir_ops = {
 	.owner = THIS_MODULE,
-	.iterate = HUST_fs_iterate,
+	.llseek = HUST_dir_llseek,
+	.read = generic_read_dir,
+	.iterate_shared = HUST_fs_iterate,
+	.fsync = HUST_fs_fsync,
+	.unlocked_ioctl = HUST_fs_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl = HUST_fs_compat_ioctl,
+#endif
 };
 
 const struct inode_operations HUST_fs_inode_ops = {
@@ -28,11 +50,20 @@ const struct inode_operations HUST_fs_inode_ops = {
 	.mkdir = HUST_fs_mkdir,
     .create = HUST_fs_create,
     .unlink = HUST_fs_unlink,
+    .fiemap = HUST_fs_fiemap,
 };
 
 const struct super_operations HUST_fs_super_ops = {
+    .alloc_inode = HUST_fs_alloc_inode,
+    .destroy_inode = HUST_fs_destroy_inode,
+    .dirty_inode = HUST_fs_dirty_inode,
     .evict_inode = HUST_evict_inode,
     .write_inode = HUST_write_inode,
+    .put_super = HUST_fs_put_super,
+    .sync_fs = HUST_fs_sync_fs,
+    .statfs = HUST_fs_statfs,
+    .remount_fs = HUST_fs_remount,
+    .show_options = HUST_fs_show_options,
 };
 
 const struct address_space_operations HUST_fs_aops = {
@@ -44,101 +75,538 @@ const struct address_space_operations HUST_fs_aops = {
 
 int save_super(struct super_block* sb)
 {
-    struct HUST_fs_super_block *disk_sb = sb->s_fs_info;
-    struct buffer_head* bh;
-    bh = sb_bread(sb, 1);
-    printk(KERN_ERR "In save bmap\n");
-    memcpy(bh->b_data, disk_sb, HUST_BLOCKSIZE);
-    map_bh(bh, sb, 1);
-    brelse(bh);
+    /*
+     * s_disk lives in the pinned superblock buffer itself; callers took
+     * journal write access to it before changing s_disk.
+     */
+    struct buffer_head* bh = HUST_SB(sb)->s_sbh;
+	return HUST_journal_dirty_metadata(sb, bh);
+}
+
+/*
+ * The free counts live in per-cpu counters, so allocation does not
+ * touch the superblock.  Their copies in it are refreshed here, a few
+ * seconds after they changed and on sync and unmount.
+ */
+int HUST_fs_commit_super(struct super_block *sb)
+{
+	struct HUST_sb_info *sbi = HUST_SB(sb);
+	handle_t *handle;
+	int err;
+
+	if (sb_rdonly(sb))
+		return 0;
+	handle = HUST_journal_start(sb, 1);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	err = HUST_journal_get_write_access(sb, sbi->s_sbh);
+	if (!err) {
+		lock_buffer(sbi->s_sbh);
+		sbi->s_disk->free_blocks =
+		    percpu_counter_sum_positive(&sbi->s_freeblocks_counter);
+		sbi->s_disk->free_inodes =
+		    percpu_counter_sum_positive(&sbi->s_freeinodes_counter);
+		unlock_buffer(sbi->s_sbh);
+		err = save_super(sb);
+	}
+	HUST_journal_stop(handle);
+	return err;
+}
+
+/*
+ * Write the superblock straight to disk with exact free counts and the
+ * clean flag, or with the flag cleared before the first change of a
+ * writable mount.  No transaction may hold the buffer: this runs before
+ * the first handle and after the journal is flushed, and every other
+ * block must be home before the flag is set.
+ */
+static int HUST_fs_write_state(struct super_block *sb, bool clean)
+{
+	struct HUST_sb_info *sbi = HUST_SB(sb);
+	struct buffer_head *bh = sbi->s_sbh;
+
+	lock_buffer(bh);
+	if (clean) {
+		sbi->s_disk->free_blocks =
+		    percpu_counter_sum_positive(&sbi->s_freeblocks_counter);
+		sbi->s_disk->free_inodes =
+		    percpu_counter_sum_positive(&sbi->s_freeinodes_counter);
+		sbi->s_disk->state |= HUST_STATE_CLEAN;
+	} else {
+		sbi->s_disk->state &= ~HUST_STATE_CLEAN;
+	}
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+	return sync_dirty_buffer(bh);
+}
+
+/* Flush the journal and everything else, then mark the fs clean. */
+static int HUST_fs_make_clean(struct super_block *sb)
+{
+	int err;
+
+	err = HUST_journal_flush(sb);
+	if (!err)
+		err = sync_blockdev(sb->s_bdev);
+	if (!err)
+		err = HUST_fs_write_state(sb, true);
+	return err;
+}
+
+/*
+ * Queue in one plugged batch what mount and the first operations read:
+ * the group descriptors, the bitmaps, whole if the free counts have to
+ * be recomputed and only their head otherwise, and the inode table
+ * around the root.  Nothing here waits for the reads.
+ */
+static void HUST_fs_mount_readahead(struct super_block *sb, bool recount)
+{
+	struct HUST_fs_super_block *disk_sb = HUST_SB(sb)->s_disk;
+	struct blk_plug plug;
+	uint64_t blk, end;
+
+	blk_start_plug(&plug);
+	if (disk_sb->features & HUST_FEATURE_GROUPS) {
+		end = disk_sb->gdt_block +
+		    DIV_ROUND_UP(disk_sb->groups_count, HUST_DESC_PER_BLOCK(sb));
+		for (blk = disk_sb->gdt_block; blk < end; blk++)
+			sb_breadahead(sb, blk);
+	}
+	end = recount ? disk_sb->imap_block :
+	    min_t(uint64_t, disk_sb->imap_block,
+		  disk_sb->bmap_block + HUST_MOUNT_BITMAP_RA);
+	for (blk = disk_sb->bmap_block; blk < end; blk++)
+		sb_breadahead(sb, blk);
+	end = recount ? disk_sb->inode_table_block :
+	    min_t(uint64_t, disk_sb->inode_table_block,
+		  disk_sb->imap_block + HUST_MOUNT_BITMAP_RA);
+	for (blk = disk_sb->imap_block; blk < end; blk++)
+		sb_breadahead(sb, blk);
+	end = disk_sb->inode_table_block + 1 + HUST_SB(sb)->s_opts.inode_readahead;
+	for (blk = disk_sb->inode_table_block; blk < end; blk++)
+		sb_breadahead(sb, blk);
+	blk_finish_plug(&plug);
+}
+
+/*
+ * After a clean unmount the free counts in the superblock are exact and
+ * mount reads no bitmap.  Otherwise they are only as recent as the last
+ * superblock update and are counted again.
+ */
+static int HUST_fs_load_counters(struct super_block *sb)
+{
+	struct HUST_sb_info *sbi = HUST_SB(sb);
+	uint64_t free_blocks, free_inodes;
+	int err;
+
+	if (sbi->s_disk->state & HUST_STATE_CLEAN) {
+		free_blocks = sbi->s_disk->free_blocks;
+		free_inodes = sbi->s_disk->free_inodes;
+	} else {
+		printk(KERN_INFO "HUST_fs: not cleanly unmounted, "
+		       "counting free blocks and inodes\n");
+		err = HUST_fs_count_free(sb, &free_blocks, &free_inodes);
+		if (err)
+			return err;
+	}
+	err = percpu_counter_init(&sbi->s_freeblocks_counter, free_blocks,
+				  GFP_KERNEL);
+	if (!err)
+		err = percpu_counter_init(&sbi->s_freeinodes_counter,
+					  free_inodes, GFP_KERNEL);
+	return err;
+}
+
+static void HUST_fs_super_work(struct work_struct *work)
+{
+	struct HUST_sb_info *sbi = container_of(to_delayed_work(work),
+						struct HUST_sb_info, s_sb_work);
+
+	if (HUST_fs_commit_super(sbi->s_sb))
+		printk(KERN_ERR "HUST_fs: cannot update the superblock\n");
+}
+
+/* A free count changed; a pending update already covers it. */
+void HUST_fs_super_changed(struct super_block *sb)
+{
+	queue_delayed_work(system_long_wq, &HUST_SB(sb)->s_sb_work,
+			   HUST_SB(sb)->s_opts.commit_interval);
+}
+
+int HUST_fs_sync_fs(struct super_block *sb, int wait)
+{
+	int err;
+
+	cancel_delayed_work(&HUST_SB(sb)->s_sb_work);
+	err = HUST_fs_commit_super(sb);
+	/* without a journal sync_filesystem() writes the buffers itself */
+	if (!err)
+		err = HUST_journal_sync(sb, wait);
+	return err;
+}
+
+int HUST_fs_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+	struct super_block *sb = dentry->d_sb;
+	struct HUST_sb_info *sbi = HUST_SB(sb);
+	u64 id = huge_encode_dev(sb->s_bdev->bd_dev);
+
+	buf->f_type = sb->s_magic;
+	buf->f_bsize = HUST_BLOCK_SIZE(sb);
+	buf->f_blocks = sbi->s_disk->blocks_count - sbi->s_disk->data_block_number;
+	buf->f_bfree = percpu_counter_sum_positive(&sbi->s_freeblocks_counter);
+	buf->f_bavail = buf->f_bfree;
+	buf->f_files = sbi->s_disk->inodes_count;
+	buf->f_ffree = percpu_counter_sum_positive(&sbi->s_freeinodes_counter);
+	buf->f_namelen = HUST_FILENAME_MAX_LEN - 1;
+	buf->f_fsid.val[0] = (u32)id;
+	buf->f_fsid.val[1] = (u32)(id >> 32);
+	return 0;
+}
+
+enum {
+	Opt_alloc_first, Opt_alloc_goal, Opt_commit, Opt_inode_readahead_blks,
+	Opt_dircache, Opt_debug, Opt_nodebug, Opt_err
+};
+
+static const match_table_t HUST_fs_tokens = {
+	{Opt_alloc_first, "alloc=first"},
+	{Opt_alloc_goal, "alloc=goal"},
+	{Opt_commit, "commit=%u"},
+	{Opt_inode_readahead_blks, "inode_readahead_blks=%u"},
+	{Opt_dircache, "dircache=%u"},
+	{Opt_debug, "debug"},
+	{Opt_nodebug, "nodebug"},
+	{Opt_err, NULL}
+};
+
+static void HUST_fs_default_options(struct HUST_mount_opts *opts)
+{
+	opts->mount_opt = 0;
+	opts->commit_interval = HUST_DEFAULT_COMMIT_SECS * HZ;
+	opts->inode_readahead = HUST_INODE_READAHEAD_BLKS;
+	opts->dircache_blocks = HUST_DIRCACHE_MIN_BLOCKS;
+}
+
+/*
+ * alloc=first|goal	  where new blocks of a file are searched from
+ * commit=N		  seconds between journal commits and superblock
+ *			  updates, 0 for the default
+ * inode_readahead_blks=N  inode table blocks read after a cold one
+ * dircache=N		  smallest directory, in blocks, given a name
+ *			  cache; 0 turns the cache off
+ * debug		  report mount and inode table events
+ *
+ * Options not given keep their value in @opts.
+ */
+static int HUST_fs_parse_options(char *options, struct HUST_mount_opts *opts)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+	int option;
+
+	if (!options)
+		return 0;
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+		switch (match_token(p, HUST_fs_tokens, args)) {
+		case Opt_alloc_first:
+			opts->mount_opt &= ~HUST_MOUNT_ALLOC_GOAL;
+			break;
+		case Opt_alloc_goal:
+			opts->mount_opt |= HUST_MOUNT_ALLOC_GOAL;
+			break;
+		case Opt_commit:
+			if (match_int(&args[0], &option) || option < 0 ||
+			    option > INT_MAX / HZ)
+				goto bad_value;
+			opts->commit_interval =
+			    (option ? option : HUST_DEFAULT_COMMIT_SECS) * HZ;
+			break;
+		case Opt_inode_readahead_blks:
+			if (match_int(&args[0], &option) || option < 0 ||
+			    option > HUST_INODE_READAHEAD_MAX)
+				goto bad_value;
+			opts->inode_readahead = option;
+			break;
+		case Opt_dircache:
+			if (match_int(&args[0], &option) || option < 0)
+				goto bad_value;
+			opts->dircache_blocks = option;
+			break;
+		case Opt_debug:
+			opts->mount_opt |= HUST_MOUNT_DEBUG;
+			break;
+		case Opt_nodebug:
+			opts->mount_opt &= ~HUST_MOUNT_DEBUG;
+			break;
+		default:
+			printk(KERN_ERR "HUST_fs: unrecognized mount option \"%s\"\n",
+			       p);
+			return -EINVAL;
+		}
+	}
+	return 0;
+ bad_value:
+	printk(KERN_ERR "HUST_fs: bad value in mount option \"%s\"\n", p);
+	return -EINVAL;
+}
+
+/* Hand the options to the parts that keep their own copy. */
+static void HUST_fs_apply_options(struct super_block *sb)
+{
+	struct HUST_sb_info *sbi = HUST_SB(sb);
+
+	if (sbi->s_journal)
+		sbi->s_journal->j_commit_interval = sbi->s_opts.commit_interval;
+}
+
+int HUST_fs_show_options(struct seq_file *seq, struct dentry *root)
+{
+	struct HUST_mount_opts *opts = &HUST_SB(root->d_sb)->s_opts;
+
+	if (opts->mount_opt & HUST_MOUNT_ALLOC_GOAL)
+		seq_puts(seq, ",alloc=goal");
+	if (opts->commit_interval != HUST_DEFAULT_COMMIT_SECS * HZ)
+		seq_printf(seq, ",commit=%lu", opts->commit_interval / HZ);
+	if (opts->inode_readahead != HUST_INODE_READAHEAD_BLKS)
+		seq_printf(seq, ",inode_readahead_blks=%u",
+			   opts->inode_readahead);
+	if (opts->dircache_blocks != HUST_DIRCACHE_MIN_BLOCKS)
+		seq_printf(seq, ",dircache=%u", opts->dircache_blocks);
+	if (opts->mount_opt & HUST_MOUNT_DEBUG)
+		seq_puts(seq, ",debug");
+	return 0;
+}
+
+int HUST_fs_remount(struct super_block *sb, int *flags, char *data)
+{
+	struct HUST_sb_info *sbi = HUST_SB(sb);
+	struct HUST_mount_opts old = sbi->s_opts;
+	int err;
+
+	sync_filesystem(sb);
+	/* lazytime is always on, see HUST_fs_fill_super() */
+	*flags |= SB_LAZYTIME;
+	err = HUST_fs_parse_options(data, &sbi->s_opts);
+	if (err) {
+		sbi->s_opts = old;
+		return err;
+	}
+	HUST_fs_apply_options(sb);
+
+	if ((*flags & SB_RDONLY) && !sb_rdonly(sb)) {
+		/* the flag is set once we return; nothing may be pending */
+		cancel_delayed_work_sync(&sbi->s_itable_work);
+		cancel_delayed_work_sync(&sbi->s_sb_work);
+		err = HUST_fs_make_clean(sb);
+	} else if (!(*flags & SB_RDONLY) && sb_rdonly(sb)) {
+		err = HUST_fs_write_state(sb, false);
+		if (!err)
+			HUST_fs_start_itable_init(sb);
+	}
+	return err;
+}
+
+static void HUST_fs_free_sb_info(struct super_block *sb)
+{
+	struct HUST_sb_info *sbi = HUST_SB(sb);
+
+	if (!sbi)
+		return;
+	HUST_journal_release(sb);
+	HUST_stats_release(sb);
+	percpu_counter_destroy(&sbi->s_freeblocks_counter);
+	percpu_counter_destroy(&sbi->s_freeinodes_counter);
+	brelse(sbi->s_sbh);
+	kvfree(sbi->s_gd);
+	kfree(sbi);
+	sb->s_fs_info = NULL;
+}
+
+void HUST_fs_put_super(struct super_block *sb)
+{
+	cancel_delayed_work_sync(&HUST_SB(sb)->s_itable_work);
+	/* evict_inodes() is done, nothing queues it again */
+	cancel_delayed_work_sync(&HUST_SB(sb)->s_sb_work);
+	/* the inodes evicted after sync_filesystem() freed blocks too */
+	if (!sb_rdonly(sb) && HUST_fs_make_clean(sb))
+		printk(KERN_ERR "HUST_fs: cannot mark the file system clean\n");
+	HUST_fs_free_sb_info(sb);
+}
+
+/*
+ * Read the superblock, which is HUST_SB_OFFSET bytes into the device
+ * whatever the block size: block 1 with 4K blocks, block 4 with 1K and
+ * the middle of block 0 with 64K.  Changing the block size drops the
+ * device's buffers, so the old one is released first.
+ */
+static int HUST_fs_read_super(struct super_block *sb, unsigned long blocksize)
+{
+	struct HUST_sb_info *sbi = HUST_SB(sb);
+	struct buffer_head *bh;
+
+	brelse(sbi->s_sbh);
+	sbi->s_sbh = NULL;
+	sbi->s_disk = NULL;
+	if (!sb_set_blocksize(sb, blocksize)) {
+		printk(KERN_ERR "HUST_fs: block size %lu not supported by the device\n",
+		       blocksize);
+		return -EINVAL;
+	}
+	bh = HUST_sb_bread(sb, HUST_SB_OFFSET / blocksize);
+	if (!bh)
+		return -EIO;
+	sbi->s_sbh = bh;
+	sbi->s_disk = (struct HUST_fs_super_block *)
+	    (bh->b_data + HUST_SB_OFFSET % blocksize);
 	return 0;
 }
 
 int HUST_fs_fill_super(struct super_block *sb, void *data, int silent)
 {
 	int ret = -EPERM;
-	struct buffer_head *bh;
-	bh = sb_bread(sb, 1);
-	BUG_ON(!bh);
+	struct HUST_sb_info *sbi;
+
+	sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
+	if (!sbi)
+		return -ENOMEM;
+	sbi->s_sb = sb;
+	HUST_fs_default_options(&sbi->s_opts);
+	mutex_init(&sbi->s_itable_mutex);
+	mutex_init(&sbi->s_grow_mutex);
+	mutex_init(&sbi->s_bmap_mutex);
+	mutex_init(&sbi->s_imap_mutex);
+	INIT_DELAYED_WORK(&sbi->s_itable_work, HUST_fs_itable_work);
+	INIT_DELAYED_WORK(&sbi->s_sb_work, HUST_fs_super_work);
+	sb->s_fs_info = sbi;
+	ret = HUST_stats_setup(sb);
+	if (ret)
+		goto failed;
+
+	ret = HUST_fs_parse_options(data, &sbi->s_opts);
+	if (ret)
+		goto failed;
+
+	/* in HUST_BLOCKSIZE units until we know the file system's own */
+	ret = HUST_fs_read_super(sb, HUST_BLOCKSIZE);
+	if (ret)
+		goto failed;
+	ret = -EPERM;
 	struct HUST_fs_super_block *sb_disk;
-	sb_disk = (struct HUST_fs_super_block *)bh->b_data;
-
-	printk(KERN_INFO "HUST_fs: version num is %lu\n", sb_disk->version);
-	printk(KERN_INFO "HUST_fs: magic num is %lu\n", sb_disk->magic);
-	printk(KERN_INFO "HUST_fs: block_size num is %lu\n",
-	       sb_disk->block_size);
-	printk(KERN_INFO "HUST_fs: inodes_count num is %lu\n",
-	       sb_disk->inodes_count);
-	printk(KERN_INFO "HUST_fs: free_blocks num is %lu\n",
-	       sb_disk->free_blocks);
-	printk(KERN_INFO "HUST_fs: blocks_count num is %lu\n",
-	       sb_disk->blocks_count);
+	sb_disk = sbi->s_disk;
+
+	if (HUST_test_opt(sb, DEBUG)) {
+		printk(KERN_INFO "HUST_fs: version num is %lu\n", sb_disk->version);
+		printk(KERN_INFO "HUST_fs: magic num is %lu\n", sb_disk->magic);
+		printk(KERN_INFO "HUST_fs: block_size num is %lu\n",
+		       sb_disk->block_size);
+		printk(KERN_INFO "HUST_fs: inodes_count num is %lu\n",
+		       sb_disk->inodes_count);
+		printk(KERN_INFO "HUST_fs: free_blocks num is %lu\n",
+		       sb_disk->free_blocks);
+		printk(KERN_INFO "HUST_fs: blocks_count num is %lu\n",
+		       sb_disk->blocks_count);
+	}
 
 	if (sb_disk->magic != MAGIC_NUM) {
 		printk(KERN_ERR "Magic number not match!\n");
-		goto release;
+		goto failed;
 	}
 
 	struct inode *root_inode;
 
-	if (sb_disk->block_size != 4096) {
-		printk(KERN_ERR "HUST_fs expects a blocksize of %d\n", 4096);
-		ret = -EFAULT;
-		goto release;
+	if (sb_disk->version != HUST_VERSION_1 &&
+	    sb_disk->version != HUST_VERSION_2) {
+		printk(KERN_ERR "HUST_fs: unsupported version %llu\n",
+		       sb_disk->version);
+		ret = -EINVAL;
+		goto failed;
+	}
+	if (sb_disk->features & ~HUST_FEATURE_SUPP) {
+		printk(KERN_ERR "HUST_fs: unsupported features %llx\n",
+		       sb_disk->features & ~HUST_FEATURE_SUPP);
+		ret = -EINVAL;
+		goto failed;
+	}
+
+	if (sb_disk->block_size < HUST_MIN_BLOCKSIZE ||
+	    sb_disk->block_size > HUST_MAX_BLOCKSIZE ||
+	    !is_power_of_2(sb_disk->block_size)) {
+		printk(KERN_ERR "HUST_fs: bad block size %llu\n",
+		       sb_disk->block_size);
+		ret = -EINVAL;
+		goto failed;
+	}
+	if (sb_disk->block_size != HUST_BLOCK_SIZE(sb)) {
+		ret = HUST_fs_read_super(sb, sb_disk->block_size);
+		if (ret)
+			goto failed;
+		sb_disk = sbi->s_disk;
 	}
+	sbi->s_inode_size = sb_disk->version >= HUST_VERSION_2 ?
+	    HUST_INODE_V2_SIZE : HUST_INODE_SIZE;
+
+	/* replay first: everything read from here on is current */
+	ret = HUST_journal_load(sb);
+	if (ret)
+		goto failed;
+	HUST_fs_apply_options(sb);
+	HUST_fs_mount_readahead(sb, !(sb_disk->state & HUST_STATE_CLEAN));
+
+	ret = HUST_fs_load_groups(sb);
+	if (ret)
+		goto failed;
+
+	ret = HUST_fs_load_counters(sb);
+	if (ret)
+		goto failed;
+	/* from here on a crash leaves the counts to be recomputed */
+	if (!sb_rdonly(sb)) {
+		ret = HUST_fs_write_state(sb, false);
+		if (ret)
+			goto failed;
+	}
+
 	//fill vfs super block
 	sb->s_magic = sb_disk->magic;
-	sb->s_fs_info = sb_disk;
-	sb->s_maxbytes = HUST_BLOCKSIZE * HUST_N_BLOCKS;	/* Max file size */
+	sb->s_maxbytes = min_t(u64, MAX_LFS_FILESIZE,
+			       HUST_BLOCK_SIZE(sb) * HUST_fs_max_blocks(sb));	/* Max file size */
 	sb->s_op = &HUST_fs_super_ops;
-
-	//-----------test get inode-----
-	struct HUST_inode raw_root_node;
-	if (HUST_fs_get_inode(sb, HUST_ROOT_INODE_NUM, &raw_root_node) != -1) {
-		printk(KERN_INFO "Get inode sucessfully!\n");
-		printk(KERN_INFO "root blocks is %llu and block[0] is %llu\n",
-		       raw_root_node.blocks, raw_root_node.block[0]);
+	sb->s_time_gran = 1;
+	/*
+	 * Timestamp-only updates stay in memory and reach the inode table
+	 * with the next real metadata write, on sync or after
+	 * dirtytime_expire_interval.  atime itself follows the VFS default
+	 * of relatime.  This is the default whatever the mount flags say,
+	 * and HUST_fs_remount() keeps it.
+	 */
+	sb->s_flags |= SB_LAZYTIME;
+
+	ret = HUST_stats_register(sb);
+	if (ret)
+		goto failed;
+
+	root_inode = HUST_fs_iget(sb, HUST_ROOT_INODE_NUM);
+	if (IS_ERR(root_inode)) {
+		ret = PTR_ERR(root_inode);
+		goto failed;
 	}
-	//-----------end test-----------
-
-	root_inode = new_inode(sb);
-	if (!root_inode)
-		return -ENOMEM;
-
-	/* Our root inode. It doesn't contain useful information for now.
-	 * Note that i_ino must not be 0, since valid inode numbers start at
-	 * 1. */
-	inode_init_owner(root_inode, NULL, S_IFDIR |
-			 S_IRUSR | S_IXUSR |
-			 S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
-	root_inode->i_sb = sb;
-	root_inode->i_ino = HUST_ROOT_INODE_NUM;
-	root_inode->i_atime = root_inode->i_mtime = root_inode->i_ctime =
-	    current_time(root_inode);
-    
-    root_inode->i_mode = raw_root_node.mode;
-    root_inode->i_size = raw_root_node.dir_children_count;
-	//root_inode->i_private = HUST_fs_get_inode(sb, HUST_ROOT_INODE_NUM);
-	/* Doesn't really matter. Since this is a directory, it "should"
-	 * have a link count of 2. See btrfs, though, where directories
-	 * always have a link count of 1. That appears to work, even though
-	 * it created a number of bug reports in other tools. :-) Just
-	 * search the web for that topic. */
-	inc_nlink(root_inode);
-
-	/* What can you do with our inode? */
-	root_inode->i_op = &HUST_fs_inode_ops;
-	root_inode->i_fop = &HUST_fs_dir_ops;
 
 	/* Make a struct dentry from our inode and store it in our
 	 * superblock. */
 	sb->s_root = d_make_root(root_inode);
-	if (!sb->s_root)
-		return -ENOMEM;
- release:
-	brelse(bh);
+	if (!sb->s_root) {
+		ret = -ENOMEM;
+		goto failed;
+	}
 
+	HUST_fs_start_itable_init(sb);
 	return 0;
+ failed:
+	HUST_fs_free_sb_info(sb);
+	return ret;
 }
 
 struct dentry *HUST_fs_mount(struct file_system_type *fs_type, int flags,
@@ -175,12 +643,32 @@ int HUST_fs_init(void)
 {
 	int ret;
 
+	BUILD_BUG_ON(sizeof(struct HUST_inode_v2) != HUST_INODE_V2_SIZE);
+	ret = HUST_init_inodecache();
+	if (ret)
+		return ret;
+	ret = HUST_dircache_init();
+	if (ret) {
+		HUST_destroy_inodecache();
+		return ret;
+	}
+	ret = HUST_stats_init();
+	if (ret) {
+		HUST_dircache_exit();
+		HUST_destroy_inodecache();
+		return ret;
+	}
+
 	ret = register_filesystem(&HUST_fs_type);
 	if (ret == 0)
 		printk(KERN_INFO "Sucessfully registered HUST_fs\n");
-	else
+	else {
 		printk(KERN_ERR "Failed to register HUST_fs. Error: [%d]\n",
 		       ret);
+		HUST_stats_exit();
+		HUST_dircache_exit();
+		HUST_destroy_inodecache();
+	}
 
 	return ret;
 }
@@ -197,6 +685,9 @@ void HUST_fs_exit(void)
 	else
 		printk(KERN_ERR "Failed to unregister HUST_fs. Error: [%d]\n",
 		       ret);
+	HUST_stats_exit();
+	HUST_dircache_exit();
+	HUST_destroy_inodecache();
 }
 
 module_init(HUST_fs_init);